@@ -31,6 +31,9 @@
 #include "callbacks.h"
 #include "config.h"
 #include "drawing.h"
+#include "render.h"
+#include "undo.h"
+#include "trace.h"
 #include "build-config.h"
 #include "coordlist_ops.h"
 #include <kpathsea/c-std.h>
@@ -47,14 +50,81 @@ gboolean on_expose (GtkWidget *widget,
 {
   GromitData *data = (GromitData *) user_data;
 
-  if(data->debug)
-    g_printerr("DEBUG: got draw event\n");
+  /*
+    Only copy what GDK asks us to repaint: the clip of 'cr' is the
+    invalidated region, which is usually a few small rectangles around
+    the pen.
+  */
+  guint64 blitted = 0;
+  GdkRectangle extents;
+  if (!gdk_cairo_get_clip_rectangle (cr, &extents))
+    {
+      extents.x = extents.y = 0;
+      extents.width = data->width;
+      extents.height = data->height;
+    }
+  cairo_region_t *exposed;
+  cairo_rectangle_list_t *clip = cairo_copy_clip_rectangle_list (cr);
+  if (clip->status == CAIRO_STATUS_SUCCESS)
+    {
+      exposed = cairo_region_create ();
+      for (int i = 0; i < clip->num_rectangles; i++)
+	{
+	  cairo_rectangle_t *r = &clip->rectangles[i];
+	  GdkRectangle area = { r->x, r->y, r->width, r->height };
+	  blitted += tiled_surface_paint (data->backbuffer, cr, &area);
+	  cairo_region_union_rectangle (exposed, &area);
+	}
+    }
+  else
+    {
+      /* clip not representable as rectangles, copy its extents */
+      blitted = tiled_surface_paint (data->backbuffer, cr, &extents);
+      exposed = cairo_region_create_rectangle (&extents);
+    }
+  cairo_rectangle_list_destroy (clip);
+
+  /* in-progress strokes and shapes go on top */
+  GHashTableIter it;
+  gpointer value;
+  g_hash_table_iter_init (&it, data->devdatatable);
+  while (g_hash_table_iter_next (&it, NULL, &value))
+    {
+      GromitDeviceData *devdata = value;
+      /* only once what the device drew is part of this repaint */
+      if (devdata->paint_time && devdata->paint_damage)
+	{
+	  cairo_region_t *painted = cairo_region_copy (devdata->paint_damage);
+	  cairo_region_intersect (painted, exposed);
+	  if (!cairo_region_is_empty (painted))
+	    {
+	      latency_record (&devdata->latency, GROMIT_LATENCY_PAINT, devdata->paint_time);
+	      devdata->paint_time = 0;
+	      cairo_region_destroy (devdata->paint_damage);
+	      devdata->paint_damage = NULL;
+	    }
+	  cairo_region_destroy (painted);
+	}
+      if (devdata->stroke)
+	tiled_surface_paint_over (devdata->stroke, cr, &extents, devdata->stroke_alpha);
+      if (!devdata->preview)
+	continue;
+      GdkRectangle *r = &devdata->preview_rect;
+      cairo_save (cr);
+      cairo_set_source_surface (cr, devdata->preview, r->x, r->y);
+      cairo_rectangle (cr, r->x, r->y, r->width, r->height);
+      cairo_fill (cr);
+      cairo_restore (cr);
+    }
 
-  cairo_save (cr);
-  cairo_set_source_surface (cr, data->backbuffer, 0, 0);
-  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-  cairo_paint (cr);
-  cairo_restore (cr);
+  cairo_region_destroy (exposed);
+
+  data->expose_count++;
+  data->expose_bytes += blitted;
+
+  if(data->debug)
+    g_printerr("DEBUG: got draw event, blitted %" G_GUINT64_FORMAT " bytes (%" G_GUINT64_FORMAT " bytes per frame on average)\n",
+	       blitted, data->expose_bytes / data->expose_count);
 
   if (data->debug) {
       // draw a pink background to know where the window is
@@ -123,24 +193,24 @@ void on_monitors_changed ( GdkScreen *screen,
   gtk_widget_input_shape_combine_region(data->win, r);
   cairo_region_destroy(r);
 
-  /* recreate the shape surface */
-  cairo_surface_t *new_shape = cairo_image_surface_create(CAIRO_FORMAT_ARGB32 ,data->width, data->height);
-  cairo_t *cr = cairo_create (new_shape);
-  cairo_set_source_surface (cr, data->backbuffer, 0, 0);
-  cairo_paint (cr);
-  cairo_destroy (cr);
-  cairo_surface_destroy(data->backbuffer);
-  data->backbuffer = new_shape;
+  /* resize the shape surface, keeping what is still on screen */
+  GHashTableIter it;
+  gpointer value;
+  g_hash_table_iter_init (&it, data->devdatatable);
+  while (g_hash_table_iter_next (&it, NULL, &value))
+    {
+      devices_flush(data, value);
+      /* strokes in progress are not smoothed anymore */
+      draw_capture_end(value);
+    }
+  tiled_surface_resize(data->backbuffer, data->width, data->height);
 
-  // recreate auxiliary backbuffer
-  cairo_surface_destroy(data->aux_backbuffer);
-  data->aux_backbuffer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, data->width, data->height);
+  // undo steps refer to the old tile layout
+  undo_clear(data);
 
   /*
      these depend on the shape surface
   */
-  GHashTableIter it;
-  gpointer value;
   g_hash_table_iter_init (&it, data->tool_config);
   while (g_hash_table_iter_next (&it, NULL, &value))
     paint_context_free(value);
@@ -151,13 +221,13 @@ void on_monitors_changed ( GdkScreen *screen,
 
 
   data->default_pen = paint_context_new (data, GROMIT_PEN, data->red, 7, 0, GROMIT_ARROW_END,
-                                         5, 10, 15, 25, 1, 0, G_MAXUINT);
+                                         5, 10, 15, 25, 1, 0, 0, G_MAXUINT);
   data->default_eraser = paint_context_new (data, GROMIT_ERASER, data->red, 75, 0, GROMIT_ARROW_END,
-                                            5, 10, 15, 25, 1, 0, G_MAXUINT);
+                                            5, 10, 15, 25, 1, 0, 0, G_MAXUINT);
 
   if(!data->composited) // set shape
     {
-      cairo_region_t* r = gdk_cairo_region_create_from_surface(data->backbuffer);
+      cairo_region_t* r = tiled_surface_create_region(data->backbuffer);
       gtk_widget_shape_combine_region(data->win, r);
       cairo_region_destroy(r);
     }
@@ -244,6 +314,11 @@ void on_clientapp_selection_received (GtkWidget *widget,
   else
     data->client = 1;
 
+  if (gtk_selection_data_get_target(selection_data) == GA_STATS &&
+      gtk_selection_data_get_length(selection_data) > 0)
+    fwrite (gtk_selection_data_get_data(selection_data), 1,
+            gtk_selection_data_get_length(selection_data), stdout);
+
   gtk_main_quit ();
 }
 
@@ -261,11 +336,11 @@ gboolean on_buttonpress (GtkWidget *win,
   gdouble pressure = 1;
 
   /* get the data for this device */
-  GromitDeviceData *devdata = g_hash_table_lookup(data->devdatatable, ev->device);
-  g_print("on_button_press\n");
+  GromitDeviceData *devdata = devices_lookup(data, ev->device);
+  TRACE(GROMIT_TRACE_DEBUG, "on_button_press");
   if(data->started_from_gui == TRUE)
   {
-    g_print("exiting on_button_press\n");
+    TRACE(GROMIT_TRACE_DEBUG, "exiting on_button_press");
     return TRUE;
   }
 
@@ -299,22 +374,23 @@ gboolean on_buttonpress (GtkWidget *win,
   if (ev->state != devdata->state ||
       devdata->lastslave != gdk_event_get_source_device ((GdkEvent *) ev))
     select_tool (data, ev->device, gdk_event_get_source_device ((GdkEvent *) ev), ev->state);
-  if (data->use_graphical_menu_items)
-    select_tool(data,ev->device,gdk_event_get_source_device((GdkEvent *) ev),ev->state);
-  g_print("set type");
+  TRACE(GROMIT_TRACE_DEBUG, "set type");
   GromitPaintType type = devdata->cur_context->type;
 
-  // store original state to have dynamic update of line and rect
-  if (type == GROMIT_LINE || type == GROMIT_RECT || type == GROMIT_SMOOTH || type == GROMIT_ORTHOGONAL)
-    {
-      copy_surface(data->aux_backbuffer, data->backbuffer);
-    }
+  /*
+    store original state to redraw smoothed strokes on release, tiles are
+    copied right before the stroke first touches them
+  */
+  if (type == GROMIT_SMOOTH || type == GROMIT_ORTHOGONAL)
+    draw_capture_begin(data, devdata);
 
   devdata->lastx = ev->x;
   devdata->lasty = ev->y;
   devdata->motion_time = ev->time;
+  predictor_reset (&devdata->predictor);
+  predictor_add (&devdata->predictor, ev->x, ev->y, ev->time);
 
-  snap_undo_state (data);
+  snap_undo_state (data, devdata);
 
   gdk_event_get_axis ((GdkEvent *) ev, GDK_AXIS_PRESSURE, &pressure);
   data->maxwidth = (CLAMP (pressure + line_thickener, 0, 1) *
@@ -326,9 +402,14 @@ gboolean on_buttonpress (GtkWidget *win,
     data->maxwidth = devdata->cur_context->maxwidth;
 
   if (ev->button <= 5)
-    draw_line (data, ev->device, ev->x, ev->y, ev->x, ev->y);
+    {
+      if (type == GROMIT_LINE || type == GROMIT_RECT)
+        draw_preview (data, devdata, ev->x, ev->y);
+      else
+        draw_line (data, devdata, ev->x, ev->y, ev->x, ev->y);
+    }
 
-  coord_list_prepend (data, ev->device, ev->x, ev->y, data->maxwidth);
+  coord_list_prepend (data, devdata, ev->x, ev->y, data->maxwidth);
 
   return TRUE;
 }
@@ -344,127 +425,169 @@ gboolean on_motion (GtkWidget *win,
   GdkTimeCoord **coords = NULL;
   gint nevents;
   int i;
-  gdouble pressure = 1;
+  GromitMotionSample sample;
   /* get the data for this device */
-  GromitDeviceData *devdata = g_hash_table_lookup(data->devdatatable, ev->device);
+  GromitDeviceData *devdata = devices_lookup(data, ev->device);
 
   if (!devdata->is_grabbed)
     return FALSE;
 
   if(data->debug)
       g_printerr("DEBUG: Device '%s': motion to (x,y)=(%.2f : %.2f)\n", gdk_device_get_name(ev->device), ev->x, ev->y);
-  g_print("on_motion\n");
+  TRACE(GROMIT_TRACE_DEBUG, "on_motion");
+  latency_record (&devdata->latency, GROMIT_LATENCY_RECEIVE, ev->time);
   if (ev->state != devdata->state ||
       devdata->lastslave != gdk_event_get_source_device ((GdkEvent *) ev))
-    select_tool (data, ev->device, gdk_event_get_source_device ((GdkEvent *) ev), ev->state);
-  g_print("type=\n");
-  GromitPaintType type = devdata->cur_context->type;
-  g_print("get_history\n");
+    {
+      /* queued samples belong to the old tool */
+      process_motion (data, devdata);
+      select_tool (data, ev->device, gdk_event_get_source_device ((GdkEvent *) ev), ev->state);
+    }
+
+  if (!devdata->motion)
+    devdata->motion = g_array_new (FALSE, FALSE, sizeof (GromitMotionSample));
+
   gdk_device_get_history (ev->device, ev->window,
 			  devdata->motion_time, ev->time,
 			  &coords, &nevents);
-  g_print("after history\n");
 
   if(!data->xinerama && nevents > 0)
     {
-      g_print("line 355\n");
-      if (type != GROMIT_LINE && type != GROMIT_RECT)
+      for (i=0; i < nevents; i++)
         {
-          for (i=0; i < nevents; i++)
-            {
-              gdouble x, y;
-              g_print("line 360\n");
-              gdk_device_get_axis (ev->device, coords[i]->axes,
-                                   GDK_AXIS_PRESSURE, &pressure);
-              if (pressure > 0)
-                {
-                  data->maxwidth = (CLAMP (pressure + line_thickener, 0, 1) *
-                                    (double) (devdata->cur_context->width -
-                                              devdata->cur_context->minwidth) +
-                                    devdata->cur_context->minwidth);
-
-                  if(data->maxwidth > devdata->cur_context->maxwidth)
-                    data->maxwidth = devdata->cur_context->maxwidth;
-                  g_print("line 372\n");
-                  gdk_device_get_axis(ev->device, coords[i]->axes,
-                                      GDK_AXIS_X, &x);
-                  gdk_device_get_axis(ev->device, coords[i]->axes,
-                                      GDK_AXIS_Y, &y);
-
-                  draw_line (data, ev->device, devdata->lastx, devdata->lasty, x, y);
-
-                  coord_list_prepend (data, ev->device, x, y, data->maxwidth);
-                  devdata->lastx = x;
-                  devdata->lasty = y;
-                  g_print("line 383\n");
-                }
-            }
+          sample.pressure = 1;
+          gdk_device_get_axis (ev->device, coords[i]->axes,
+                               GDK_AXIS_PRESSURE, &sample.pressure);
+          gdk_device_get_axis (ev->device, coords[i]->axes,
+                               GDK_AXIS_X, &sample.x);
+          gdk_device_get_axis (ev->device, coords[i]->axes,
+                               GDK_AXIS_Y, &sample.y);
+          sample.history = TRUE;
+          sample.time = coords[i]->time;
+          g_array_append_val (devdata->motion, sample);
         }
-      g_print("line 388\n");
       devdata->motion_time = coords[nevents-1]->time;
       g_free (coords);
     }
-g_print("line 392\n");
+
   /* always paint to the current event coordinate. */
-  gdk_event_get_axis ((GdkEvent *) ev, GDK_AXIS_PRESSURE, &pressure);
+  sample.pressure = 1;
+  gdk_event_get_axis ((GdkEvent *) ev, GDK_AXIS_PRESSURE, &sample.pressure);
+  sample.x = ev->x;
+  sample.y = ev->y;
+  /* without a motion time, only the position is tracked */
+  sample.history = FALSE;
+  sample.time = ev->time;
+  if (devdata->motion_time == 0)
+    sample.pressure = 0;
+  g_array_append_val (devdata->motion, sample);
+
+  devdata->motion_time = ev->time;
+
+  /* rasterized once per frame by process_all_motion() */
+  render_request_frame (data);
+
+  return TRUE;
+}
+
+
+/*
+ * Draw the queued motion samples of a device.
+ */
+void process_motion (GromitData *data,
+		     GromitDeviceData *devdata)
+{
+  if (!devdata->motion || devdata->motion->len == 0)
+    return;
 
-  if (pressure > 0)
+  /* no tool selected since the devices were set up again */
+  if (!devdata->cur_context)
     {
-      g_print("pressure\n");
-      data->maxwidth = (CLAMP (pressure + line_thickener, 0, 1) *
-			(double) (devdata->cur_context->width -
-				  devdata->cur_context->minwidth) +
-			devdata->cur_context->minwidth);
+      g_array_set_size (devdata->motion, 0);
+      return;
+    }
 
-      if(data->maxwidth > devdata->cur_context->maxwidth)
-	data->maxwidth = devdata->cur_context->maxwidth;
+  GromitPaintType type = devdata->cur_context->type;
+  GromitMotionSample *samples = (GromitMotionSample *) devdata->motion->data;
+  guint n = devdata->motion->len;
+  guint i;
 
-      if(devdata->motion_time > 0)
-	{
-          if (type == GROMIT_LINE || type == GROMIT_RECT) {
-            copy_surface(data->backbuffer, data->aux_backbuffer);
-            GdkRectangle rect = {0, 0, data->width, data->height};
-            gdk_window_invalidate_rect(gtk_widget_get_window(data->win), &rect, 0);
-          }
-          if (type == GROMIT_LINE)
-            {
-              GromitArrowType atype = devdata->cur_context->arrow_type;
-	      draw_line (data, ev->device, devdata->lastx, devdata->lasty, ev->x, ev->y);
-              if (devdata->cur_context->arrowsize > 0)
-                {
-                  GromitArrowType atype = devdata->cur_context->arrow_type;
-                  gint width = devdata->cur_context->arrowsize * devdata->cur_context->width / 2;
-                  gfloat direction =
-                      atan2(ev->y - devdata->lasty, ev->x - devdata->lastx);
-                  if (atype & GROMIT_ARROW_END)
-                    draw_arrow(data, ev->device, ev->x, ev->y, width * 2, direction);
-                  if (atype & GROMIT_ARROW_START)
-                    draw_arrow(data, ev->device, devdata->lastx, devdata->lasty, width * 2, M_PI + direction);
-                }
-            }
-          else if (type == GROMIT_RECT)
-            {
-              draw_line (data, ev->device, devdata->lastx, devdata->lasty, ev->x, devdata->lasty);
-              draw_line (data, ev->device, ev->x, devdata->lasty, ev->x, ev->y);
-              draw_line (data, ev->device, ev->x, ev->y, devdata->lastx, ev->y);
-              draw_line (data, ev->device, devdata->lastx, ev->y, devdata->lastx, devdata->lasty);
-            }
+  data->motion_samples += n;
+  data->motion_batches++;
+
+  /* LINE and RECT only show the latest position */
+  if (type == GROMIT_LINE || type == GROMIT_RECT)
+    {
+      samples += n - 1;
+      n = 1;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      GromitMotionSample *sample = &samples[i];
+
+      if (sample->history && (type == GROMIT_LINE || type == GROMIT_RECT))
+        continue;
+
+      if (sample->pressure > 0)
+        {
+          devdata->draw_time = sample->time;
+          if (!devdata->paint_time)
+            devdata->paint_time = sample->time;
+
+          data->maxwidth = (CLAMP (sample->pressure + line_thickener, 0, 1) *
+                            (double) (devdata->cur_context->width -
+                                      devdata->cur_context->minwidth) +
+                            devdata->cur_context->minwidth);
+
+          if(data->maxwidth > devdata->cur_context->maxwidth)
+            data->maxwidth = devdata->cur_context->maxwidth;
+
+          if (type == GROMIT_LINE || type == GROMIT_RECT)
+            draw_preview (data, devdata, sample->x, sample->y);
           else
             {
-              draw_line (data, ev->device, devdata->lastx, devdata->lasty, ev->x, ev->y);
-	      coord_list_prepend (data, ev->device, ev->x, ev->y, data->maxwidth);
+              draw_line (data, devdata, devdata->lastx, devdata->lasty, sample->x, sample->y);
+              coord_list_prepend (data, devdata, sample->x, sample->y, data->maxwidth);
+              if (sample->time)
+                predictor_add (&devdata->predictor, sample->x, sample->y, sample->time);
             }
-	}
+        }
+      else if (sample->history)
+        continue;
+
+      if (type != GROMIT_LINE && type != GROMIT_RECT)
+        {
+          devdata->lastx = sample->x;
+          devdata->lasty = sample->y;
+        }
     }
 
+  g_array_set_size (devdata->motion, 0);
+  devdata->draw_time = 0;
+
+  /* ink up to where the pen will be when this frame is shown */
   if (type != GROMIT_LINE && type != GROMIT_RECT)
     {
-      devdata->lastx = ev->x;
-      devdata->lasty = ev->y;
+      gdouble x, y;
+      if (type != GROMIT_ERASER && type != GROMIT_RECOLOR &&
+          devdata->cur_context->predict > 0 && samples[n - 1].pressure > 0 &&
+          predictor_predict (&devdata->predictor, devdata->cur_context->predict, &x, &y))
+        draw_prediction (data, devdata, x, y);
+      else
+        draw_preview_cancel (data, devdata);
     }
-  devdata->motion_time = ev->time;
-  g_print("finished on_motion");
-  return TRUE;
+}
+
+
+void process_all_motion (GromitData *data)
+{
+  GHashTableIter it;
+  gpointer value;
+
+  g_hash_table_iter_init (&it, data->devdatatable);
+  while (g_hash_table_iter_next (&it, NULL, &value))
+    process_motion (data, value);
 }
 
 
@@ -473,18 +596,18 @@ gboolean on_buttonrelease (GtkWidget *win,
 			   gpointer user_data)
 {
   GromitData *data = (GromitData *) user_data;
-  g_print("on_buttonrelease\n");
+  TRACE(GROMIT_TRACE_DEBUG, "on_buttonrelease");
   /* get the device data for this event */
-  GromitDeviceData *devdata = g_hash_table_lookup(data->devdatatable, ev->device);
+  GromitDeviceData *devdata = devices_lookup(data, ev->device);
   GromitPaintContext *ctx = devdata->cur_context;
   if (data->use_graphical_menu_items)
   {
-    g_print("use_graphical_menu_items\n");
+    TRACE(GROMIT_TRACE_DEBUG, "use_graphical_menu_items");
     int index = data->current_graph_menu_tool;
     ctx = data->graph_menu_tools[index][data->current_graph_menu_type[index]];
     if (data->started_from_gui == TRUE)
     {
-      g_print("data->started_from_gui\n");
+      TRACE(GROMIT_TRACE_DEBUG, "data->started_from_gui");
       data->started_from_gui = FALSE;
       return TRUE;
     }
@@ -495,19 +618,24 @@ gboolean on_buttonrelease (GtkWidget *win,
   gint width = 0;
   if(ctx)
     width = ctx->arrowsize * ctx->width / 2;
-  g_print("on_buttonrelease\n");
+  TRACE(GROMIT_TRACE_DEBUG, "on_buttonrelease");
   if ((ev->x != devdata->lastx) ||
       (ev->y != devdata->lasty))
     on_motion(win, (GdkEventMotion *) ev, user_data);
-  g_print("after on_motion_called\n");
+  /* the stroke has to be complete before it is post-processed */
+  process_motion (data, devdata);
+  draw_preview_commit (data, devdata);
+  TRACE(GROMIT_TRACE_DEBUG, "after on_motion_called");
   if (!devdata->is_grabbed)
     return FALSE;
-  g_print("after is grabbed\n");
+  TRACE(GROMIT_TRACE_DEBUG, "after is grabbed");
   GromitPaintType type = ctx->type;
-  g_print("after typ=\n");
+  TRACE(GROMIT_TRACE_DEBUG, "after typ=");
   if (type == GROMIT_SMOOTH || type == GROMIT_ORTHOGONAL)
     {
       gboolean joined = FALSE;
+      GdkRectangle raw, smoothed, rect;
+      coord_list_get_extents(devdata->coordlist, &raw);
       douglas_peucker(devdata->coordlist, ctx->simplify);
       if (ctx->snapdist > 0)
         joined = snap_ends(devdata->coordlist, ctx->snapdist);
@@ -519,9 +647,15 @@ gboolean on_buttonrelease (GtkWidget *win,
           round_corners(devdata->coordlist, ctx->radius, 6, joined);
       }
 
-      copy_surface(data->backbuffer, data->aux_backbuffer);
-      GdkRectangle rect = {0, 0, data->width, data->height};
-      gdk_window_invalidate_rect(gtk_widget_get_window(data->win), &rect, 0);
+      /* only the area of the raw and the smoothed stroke changes */
+      coord_list_get_extents(devdata->coordlist, &smoothed);
+      gdk_rectangle_union(&raw, &smoothed, &rect);
+
+      draw_flush_all(data);
+      draw_capture_restore(data, devdata, &rect);
+      draw_capture_end(devdata);
+      undo_log_discard(data);
+      damage_add_rect(data, &rect);
 
       GList *ptr = devdata->coordlist;
       while (ptr && ptr->next)
@@ -529,10 +663,13 @@ gboolean on_buttonrelease (GtkWidget *win,
           GromitStrokeCoordinate *c1 = ptr->data;
           GromitStrokeCoordinate *c2 = ptr->next->data;
           ptr = ptr->next;
-          draw_line (data, ev->device, c1->x, c1->y, c2->x, c2->y);
+          /* keep the pressure of the original stroke */
+          if (type == GROMIT_SMOOTH)
+            data->maxwidth = c2->width;
+          draw_line (data, devdata, c1->x, c1->y, c2->x, c2->y);
         }
     }
-  g_print("before ctx->arrowsize\n");
+  TRACE(GROMIT_TRACE_DEBUG, "before ctx->arrowsize");
   if (ctx->arrowsize != 0)
     {
       GromitArrowType atype = ctx->arrow_type;
@@ -540,30 +677,61 @@ gboolean on_buttonrelease (GtkWidget *win,
         {
           direction = atan2 (ev->y - devdata->lasty, ev->x - devdata->lastx);
           if (atype & GROMIT_ARROW_END)
-            draw_arrow(data, ev->device, ev->x, ev->y, width * 2, direction);
+            draw_arrow(data, devdata, ev->x, ev->y, width * 2, direction);
           if (atype & GROMIT_ARROW_START)
-            draw_arrow(data, ev->device, devdata->lastx, devdata->lasty, width * 2, M_PI + direction);
+            draw_arrow(data, devdata, devdata->lastx, devdata->lasty, width * 2, M_PI + direction);
         }
       else
         {
           gint x0, y0;
           if ((atype & GROMIT_ARROW_END) &&
-              coord_list_get_arrow_param (data, ev->device, width * 3,
+              coord_list_get_arrow_param (data, devdata, width * 3,
                                           GROMIT_ARROW_END, &x0, &y0, &width, &direction))
-            draw_arrow (data, ev->device, x0, y0, width, direction);
+            draw_arrow (data, devdata, x0, y0, width, direction);
           if ((atype & GROMIT_ARROW_START) &&
-              coord_list_get_arrow_param (data, ev->device, width * 3,
+              coord_list_get_arrow_param (data, devdata, width * 3,
                                           GROMIT_ARROW_START, &x0, &y0, &width, &direction)) {
-            draw_arrow (data, ev->device, x0, y0, width, direction);
+            draw_arrow (data, devdata, x0, y0, width, direction);
           }
         }
     }
-  g_print("after on_button_release\n");
-  coord_list_free (data, ev->device);
+  TRACE(GROMIT_TRACE_DEBUG, "after on_button_release");
+  draw_stroke_end (data, devdata);
+  coord_list_free (data, devdata);
+  undo_finish_step (data, devdata);
+  undo_journal_schedule (data);
 
   return TRUE;
 }
 
+
+/*
+ * Latency histograms of all devices that saw input, for --stats.
+ */
+static GString *latency_report (GromitData *data)
+{
+  GString *out = g_string_new (NULL);
+  GHashTableIter it;
+  gpointer value;
+
+  g_hash_table_iter_init (&it, data->devdatatable);
+  while (g_hash_table_iter_next (&it, NULL, &value))
+    {
+      GromitDeviceData *devdata = value;
+      if (devdata->latency.stage[GROMIT_LATENCY_RECEIVE].total == 0 &&
+          devdata->latency.stage[GROMIT_LATENCY_RECEIVE].dropped == 0)
+        continue;
+      g_string_append_printf (out, "%u '%s'\n", devdata->index,
+                              gdk_device_get_name (devdata->device));
+      latency_print (out, &devdata->latency);
+    }
+
+  if (out->len == 0)
+    g_string_append (out, "no input yet\n");
+  return out;
+}
+
+
 /* Remote control */
 void on_mainapp_selection_get (GtkWidget          *widget,
 			       GtkSelectionData   *selection_data,
@@ -574,6 +742,7 @@ void on_mainapp_selection_get (GtkWidget          *widget,
   GromitData *data = (GromitData *) user_data;
 
   gchar *uri = "OK";
+  GString *stats = NULL;
   GdkAtom action = gtk_selection_data_get_target(selection_data);
 
   if(action == GA_TOGGLE)
@@ -599,9 +768,9 @@ void on_mainapp_selection_get (GtkWidget          *widget,
   else if (action == GA_QUIT)
     gtk_main_quit ();
   else if (action == GA_UNDO)
-    undo_drawing (data);
+    undo_drawing (data, NULL);
   else if (action == GA_REDO)
-    redo_drawing (data);
+    redo_drawing (data, NULL);
   else if (action == GA_GUIMENU)
   {
     on_menu_toggle(NULL,data);
@@ -614,6 +783,11 @@ void on_mainapp_selection_get (GtkWidget          *widget,
       on_window_close(NULL,data);
     gtk_main_quit();
   }
+  else if (action == GA_STATS)
+  {
+    stats = latency_report (data);
+    uri = stats->str;
+  }
   else
     uri = "NOK";
 
@@ -621,6 +795,8 @@ void on_mainapp_selection_get (GtkWidget          *widget,
   gtk_selection_data_set (selection_data,
                           gtk_selection_data_get_target(selection_data),
                           8, (guchar*)uri, strlen (uri));
+  if (stats)
+    g_string_free (stats, TRUE);
 }
 
 
@@ -701,7 +877,7 @@ void on_mainapp_selection_received (GtkWidget *widget,
 	    }
 	  GromitPaintContext* line_ctx =
             paint_context_new(data, GROMIT_PEN, fg_color, thickness, 0, GROMIT_ARROW_END,
-                              5, 10, 15, 25, 0, thickness, thickness);
+                              5, 10, 15, 25, 0, 0, thickness, thickness);
 
 	  GdkRectangle rect;
 	  rect.x = MIN (startX,endX) - thickness / 2;
@@ -712,13 +888,19 @@ void on_mainapp_selection_received (GtkWidget *widget,
 	  if(data->debug)
 	    g_printerr("DEBUG: draw line from %d %d to %d %d\n", startX, startY, endX, endY);
 
+	  draw_flush_all(data);
 	  cairo_set_line_width(line_ctx->paint_ctx, thickness);
 	  cairo_move_to(line_ctx->paint_ctx, startX, startY);
 	  cairo_line_to(line_ctx->paint_ctx, endX, endY);
-	  cairo_stroke(line_ctx->paint_ctx);
+	  tiled_surface_stroke(data->backbuffer, line_ctx->paint_ctx);
+
+	  /* replayed as a stroked LINE, which renders the same */
+	  GromitStrokeSegment segment = { startX, startY, endX, endY, thickness };
+	  line_ctx->type = GROMIT_LINE;
+	  undo_log_segments(data, line_ctx, &segment, 1);
 
 	  data->modified = 1;
-	  gdk_window_invalidate_rect(gtk_widget_get_window(data->win), &rect, 0);
+	  damage_add_rect(data, &rect);
 	  data->painted = 1;
 
 	  g_free(line_ctx);
@@ -736,6 +918,9 @@ void on_device_removed (GdkDeviceManager *device_manager,
 {
   GromitData *data = (GromitData *) user_data;
 
+  /* a slave's GdkDevice may be reused for another one */
+  tool_cache_clear(data);
+
   if(gdk_device_get_device_type(device) != GDK_DEVICE_TYPE_MASTER
      || gdk_device_get_n_axes(device) < 2)
     return;
@@ -752,6 +937,9 @@ void on_device_added (GdkDeviceManager *device_manager,
 {
   GromitData *data = (GromitData *) user_data;
 
+  /* see on_device_removed() */
+  tool_cache_clear(data);
+
   if(gdk_device_get_device_type(device) != GDK_DEVICE_TYPE_MASTER
      || gdk_device_get_n_axes(device) < 2)
     return;
@@ -783,6 +971,7 @@ void on_window_close(GtkWidget *button, gpointer user_data) {
     GromitData * data = (GromitData *) user_data;
     data->use_graphical_menu_items = FALSE;
     data->gui_menu_toggle = FALSE;
+    tool_cache_clear(data);
     save_values(data);
     //GtkWidget *window = GTK_WIDGET(user_data);  // Get the window passed as user data
     gtk_window_close(GTK_WINDOW(data->gui_window));  // Close the window
@@ -937,6 +1126,7 @@ void add_tool_to_key_file(GKeyFile *key_file,gchar* tool_str,
       g_key_file_set_integer(key_file,tool_str,"maxangle",tool_type->maxangle);
       g_key_file_set_integer(key_file,tool_str,"simplify",tool_type->simplify);
       g_key_file_set_integer(key_file,tool_str,"snapdist",tool_type->snapdist);
+      g_key_file_set_integer(key_file,tool_str,"predict",tool_type->predict);
       gdouble color[] = {tool_type->paint_color->red,tool_type->paint_color->green,
                           tool_type->paint_color->blue,tool_type->paint_color->alpha};
       guint length = sizeof(color) / sizeof(color[0]);
@@ -1467,12 +1657,12 @@ void on_toggle_paint_gui(GtkWidget *widget,
 void on_undo_button(GtkWidget *widget,gpointer user_data)
 {
   GromitData * data = (GromitData *) user_data;
-  undo_drawing(data);
+  undo_drawing(data, NULL);
 }
 void on_redo_button(GtkWidget *widget,gpointer user_data)
 {
   GromitData * data = (GromitData *) user_data;
-  redo_drawing(data);
+  redo_drawing(data, NULL);
 }
 void on_opacity_changed(GtkWidget *widget, gpointer user_data)
 {
@@ -1492,6 +1682,7 @@ void on_tool_changed(GtkComboBox *tool_combo, gpointer user_data)
   gtk_container_remove(hbox,vbox);
   CustomData *custom_data = (CustomData *)g_object_get_data(G_OBJECT(tool_combo), "custom-data");
   data->current_graph_menu_type[custom_data->radio_nb]=gtk_combo_box_get_active((GtkComboBox*)tool_combo);
+  tool_cache_clear(data);
   vbox = set_appropriate_tool_options(vbox,custom_data->radio_nb,data);
   gtk_box_pack_start(hbox,vbox,FALSE,FALSE,0);
   gtk_widget_show_all(vbox);
@@ -1601,6 +1792,7 @@ void radio_toggled(GtkWidget *widget,gpointer user_data)
   GromitData * data = (GromitData *) user_data;
   CustomData * custom_data = g_object_get_data(widget,"custom-data");
   data->current_graph_menu_tool = custom_data->radio_nb;
+  tool_cache_clear(data);
   //save_values(data);
   //GromitPaintContext *tool = data->graph_menu_tools[custom_data->radio_nb][data->current_graph_menu_type[custom_data->radio_nb]];
 
@@ -1664,6 +1856,8 @@ void read_tool_from_key_file(GKeyFile *key_file,gchar* tool_str,
       tool_type->maxangle = g_key_file_get_integer(key_file,tool_str,"maxangle",&error);
       tool_type->simplify = g_key_file_get_integer(key_file,tool_str,"simplify",&error);
       tool_type->snapdist = g_key_file_get_integer(key_file,tool_str,"snapdist",&error);
+      /* not in files written before prediction existed */
+      tool_type->predict = g_key_file_get_integer(key_file,tool_str,"predict",NULL);
       g_print("here10");
       guint length;
       g_print("here20");
@@ -1684,7 +1878,7 @@ void read_tool_from_key_file(GKeyFile *key_file,gchar* tool_str,
 }
 void make_paint_ctx(GromitPaintContext *tool_type,GromitData *data)
 {
-  tool_type->paint_ctx = cairo_create (data->backbuffer);
+  tool_type->paint_ctx = cairo_create (data->backbuffer->proxy);
 
   gdk_cairo_set_source_rgba(tool_type->paint_ctx, tool_type->paint_color);
   if(!data->composited)
@@ -1726,6 +1920,7 @@ void load_tool_default(GromitPaintContext ** tool_type,GromitPaintType type,int
     (*tool_type)->maxangle = 15;
     (*tool_type)->simplify = 10;
     (*tool_type)->snapdist = 0;
+    (*tool_type)->predict = 0;
     (*tool_type)->paint_color = g_list_nth_data(color_list,tool_nb%g_list_length(color_list));
     make_paint_ctx(*tool_type,data);
 }
@@ -1787,6 +1982,7 @@ gboolean on_menu_toggle(GtkMenuItem *menuitem, gpointer user_data)
  
   setup_tools(data);
   data->use_graphical_menu_items = TRUE;
+  tool_cache_clear(data);
   //g_print("world");
   int MENU_WIDTH=25;
   int MENU_HEIGHT=600;
@@ -2023,14 +2219,14 @@ void on_undo(GtkMenuItem *menuitem,
 	     gpointer     user_data)
 {
   GromitData *data = (GromitData *) user_data;
-  undo_drawing (data);
+  undo_drawing (data, NULL);
 }
 
 void on_redo(GtkMenuItem *menuitem,
 	     gpointer     user_data)
 {
   GromitData *data = (GromitData *) user_data;
-  redo_drawing (data);
+  redo_drawing (data, NULL);
 }
 
 
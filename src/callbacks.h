@@ -64,6 +64,9 @@ gboolean on_buttonpress (GtkWidget *win, GdkEventButton *ev, gpointer user_data)
 
 gboolean on_motion (GtkWidget *win, GdkEventMotion *ev, gpointer user_data);
 
+void process_motion (GromitData *data, GromitDeviceData *devdata);
+void process_all_motion (GromitData *data);
+
 gboolean on_buttonrelease (GtkWidget *win, GdkEventButton *ev, gpointer user_data);
 
 void on_mainapp_selection_get (GtkWidget          *widget,
@@ -0,0 +1,114 @@
+
+#include <string.h>
+#include <lz4.h>
+#include <lz4hc.h>
+#include "build-config.h"
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "codec.h"
+
+/* favour speed, undo steps are compressed while drawing */
+#define ZSTD_LEVEL 3
+
+
+static gsize raw_bound (gsize size)
+{
+  return size;
+}
+
+
+static gsize raw_compress (const gchar *src, gsize size, gchar *dst, gsize capacity)
+{
+  if (size > capacity)
+    return 0;
+  memcpy (dst, src, size);
+  return size;
+}
+
+
+static gssize raw_decompress (const gchar *src, gsize size, gchar *dst, gsize capacity)
+{
+  return raw_compress (src, size, dst, capacity) == size ? (gssize) size : -1;
+}
+
+
+static gsize lz4_bound (gsize size)
+{
+  return LZ4_compressBound (size);
+}
+
+
+static gsize lz4_compress (const gchar *src, gsize size, gchar *dst, gsize capacity)
+{
+  return MAX (LZ4_compress_default (src, dst, size, capacity), 0);
+}
+
+
+static gsize lz4hc_compress (const gchar *src, gsize size, gchar *dst, gsize capacity)
+{
+  return MAX (LZ4_compress_HC (src, dst, size, capacity, LZ4HC_CLEVEL_DEFAULT), 0);
+}
+
+
+/* LZ4-HC writes plain LZ4 blocks */
+static gssize lz4_decompress (const gchar *src, gsize size, gchar *dst, gsize capacity)
+{
+  int ret = LZ4_decompress_safe (src, dst, size, capacity);
+  return ret < 0 ? -1 : ret;
+}
+
+
+#ifdef HAVE_ZSTD
+static gsize zstd_bound (gsize size)
+{
+  return ZSTD_compressBound (size);
+}
+
+
+static gsize zstd_compress (const gchar *src, gsize size, gchar *dst, gsize capacity)
+{
+  size_t ret = ZSTD_compress (dst, capacity, src, size, ZSTD_LEVEL);
+  return ZSTD_isError (ret) ? 0 : ret;
+}
+
+
+static gssize zstd_decompress (const gchar *src, gsize size, gchar *dst, gsize capacity)
+{
+  size_t ret = ZSTD_decompress (dst, capacity, src, size);
+  return ZSTD_isError (ret) ? -1 : (gssize) ret;
+}
+#endif
+
+
+static const GromitCodec codecs[] = {
+  { GROMIT_CODEC_RAW,   "raw",   raw_bound,  raw_compress,   raw_decompress },
+  { GROMIT_CODEC_LZ4,   "lz4",   lz4_bound,  lz4_compress,   lz4_decompress },
+  { GROMIT_CODEC_LZ4HC, "lz4hc", lz4_bound,  lz4hc_compress, lz4_decompress },
+#ifdef HAVE_ZSTD
+  { GROMIT_CODEC_ZSTD,  "zstd",  zstd_bound, zstd_compress,  zstd_decompress },
+#endif
+};
+
+const GromitCodec *codec_by_name (const gchar *name)
+{
+  for (guint i = 0; i < G_N_ELEMENTS (codecs); i++)
+    if (g_strcmp0 (codecs[i].name, name) == 0)
+      return &codecs[i];
+  return NULL;
+}
+
+
+const GromitCodec *codec_by_id (guint id)
+{
+  for (guint i = 0; i < G_N_ELEMENTS (codecs); i++)
+    if (codecs[i].id == id)
+      return &codecs[i];
+  return NULL;
+}
+
+
+const GromitCodec *codec_default (void)
+{
+  return codec_by_id (GROMIT_CODEC_LZ4);
+}
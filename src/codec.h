@@ -0,0 +1,39 @@
+
+#ifndef CODEC_H
+#define CODEC_H
+
+/*
+  General-purpose compressors for undo tiles, picked with UndoCodec in the
+  config. Compressed data is tagged with the codec's id, so that it can
+  still be decompressed after the setting changed, e.g. from the journal.
+*/
+
+#include <glib.h>
+
+typedef enum
+{
+  GROMIT_CODEC_RAW = 0,
+  GROMIT_CODEC_LZ4 = 1,
+  GROMIT_CODEC_LZ4HC = 2,
+  GROMIT_CODEC_ZSTD = 3
+} GromitCodecId;
+
+typedef struct _GromitCodec
+{
+  GromitCodecId id;
+  const gchar  *name;
+  /* largest compressed size of 'size' bytes */
+  gsize  (*bound) (gsize size);
+  /* returns the compressed size, 0 on failure */
+  gsize  (*compress) (const gchar *src, gsize size, gchar *dst, gsize capacity);
+  /* returns the decompressed size, -1 on failure */
+  gssize (*decompress) (const gchar *src, gsize size, gchar *dst, gsize capacity);
+} GromitCodec;
+
+
+/* NULL if there is no such codec in this build */
+const GromitCodec *codec_by_name (const gchar *name);
+const GromitCodec *codec_by_id (guint id);
+const GromitCodec *codec_default (void);
+
+#endif
@@ -30,10 +30,14 @@
 
 #include "config.h"
 #include "main.h"
+#include "drawing.h"
 #include "math.h"
 #include "build-config.h"
+#include "codec.h"
 
 #define KEY_DFLT_SHOW_INTRO_ON_STARTUP TRUE
+#define KEY_DFLT_UNDO_MEMORY_MB GROMIT_DEFAULT_UNDO_MEMORY_MB
+#define KEY_DFLT_UNDO_KEYFRAME_INTERVAL GROMIT_DEFAULT_UNDO_KEYFRAME_INTERVAL
 
 #define KEYFILE_FLAGS G_KEY_FILE_KEEP_COMMENTS|G_KEY_FILE_KEEP_TRANSLATIONS
 
@@ -124,6 +128,7 @@ enum tool_arguments {
   SYM_RADIUS,
   SYM_SIMPLIFY,
   SYM_SNAP,
+  SYM_PREDICT,
 };
 
 /*
@@ -164,7 +169,7 @@ gboolean parse_config (GromitData *data)
   GromitPaintType type;
   GdkRGBA *fg_color=NULL;
   guint width, arrowsize, minwidth, maxwidth;
-  guint minlen, maxangle, radius, simplify, snapdist;
+  guint minlen, maxangle, radius, simplify, snapdist, predict;
   GromitArrowType arrowtype;
 
   /* try user config location */
@@ -239,6 +244,7 @@ gboolean parse_config (GromitData *data)
   g_scanner_scope_add_symbol (scanner, 2, "minlen",    (gpointer) SYM_MINLEN);
   g_scanner_scope_add_symbol (scanner, 2, "simplify",  (gpointer) SYM_SIMPLIFY);
   g_scanner_scope_add_symbol (scanner, 2, "snap",      (gpointer) SYM_SNAP);
+  g_scanner_scope_add_symbol (scanner, 2, "predict",   (gpointer) SYM_PREDICT);
 
   g_scanner_set_scope (scanner, 0);
   scanner->config->scope_0_fallback = 0;
@@ -282,6 +288,7 @@ gboolean parse_config (GromitData *data)
           maxangle = 15;
           simplify = 10;
           snapdist = 0;
+          predict = 0;
           fg_color = data->red;
 
           if (token == G_TOKEN_SYMBOL)
@@ -307,6 +314,7 @@ gboolean parse_config (GromitData *data)
                   minlen = context_template->minlen;
                   maxangle = context_template->maxangle;
                   snapdist = context_template->snapdist;
+                  predict = context_template->predict;
                   minwidth = context_template->minwidth;
 		  maxwidth = context_template->maxwidth;
                   fg_color = context_template->paint_color;
@@ -448,6 +456,12 @@ gboolean parse_config (GromitData *data)
                           if (isnan(v)) goto cleanup;
                           snapdist = v;
                         }
+                      else if ((intptr_t) scanner->value.v_symbol == SYM_PREDICT)
+                        {
+                          gfloat v = parse_get_float(scanner, "Missing prediction horizon (float)");
+                          if (isnan(v)) goto cleanup;
+                          predict = v;
+                        }
 		      else
                         {
                           g_printerr ("Unknown tool type?????\n");
@@ -475,7 +489,7 @@ gboolean parse_config (GromitData *data)
 
           context = paint_context_new (data, type, fg_color, width,
                                        arrowsize, arrowtype,
-                                       simplify, radius, maxangle, minlen, snapdist,
+                                       simplify, radius, maxangle, minlen, snapdist, predict,
                                        minwidth, maxwidth);
           g_hash_table_insert (data->tool_config, name, context);
         }
@@ -540,6 +554,7 @@ gboolean parse_config (GromitData *data)
       /* purge incomplete tool config */
       GHashTableIter it;
       gpointer value;
+      draw_flush_all(data);
       g_hash_table_iter_init (&it, data->tool_config);
       while (g_hash_table_iter_next (&it, NULL, &value))
 	  paint_context_free(value);
@@ -706,6 +721,13 @@ void read_keyfile(GromitData *data)
       set defaults
     */
     data->show_intro_on_startup = KEY_DFLT_SHOW_INTRO_ON_STARTUP;
+    data->undo_budget = (gsize) KEY_DFLT_UNDO_MEMORY_MB << 20;
+    data->undo_engine = GROMIT_UNDO_TILES;
+    data->undo_keyframe_interval = KEY_DFLT_UNDO_KEYFRAME_INTERVAL;
+    data->undo_journal_enabled = FALSE;
+    data->undo_per_device = FALSE;
+    data->undo_codec = codec_default ();
+    data->xi2_motion = FALSE;
 
     /*
       read actual settings
@@ -726,6 +748,39 @@ void read_keyfile(GromitData *data)
     // 0.0 on not-found, but anyway, also don't use 0.0 when user-set
     if(data->opacity == 0)
 	data->opacity = DEFAULT_OPACITY;
+    // 0 on not-found, a budget of 0 would disable undo entirely
+    gint undo_mb = g_key_file_get_integer (key_file, "General", "UndoMemoryMB", NULL);
+    if(undo_mb > 0)
+	data->undo_budget = (gsize) undo_mb << 20;
+    // "tiles" keeps the changed pixels, "commands" the strokes plus keyframes
+    gchar *undo_engine = g_key_file_get_string (key_file, "General", "UndoEngine", NULL);
+    if(g_strcmp0(undo_engine, "commands") == 0)
+	data->undo_engine = GROMIT_UNDO_COMMANDS;
+    else if(undo_engine && g_strcmp0(undo_engine, "tiles") != 0)
+	g_warning ("Unknown UndoEngine '%s', using 'tiles'", undo_engine);
+    g_free(undo_engine);
+    // strokes between keyframes, bounds the replay on undo
+    gint interval = g_key_file_get_integer (key_file, "General", "UndoKeyframeInterval", NULL);
+    if(interval > 0)
+	data->undo_keyframe_interval = interval;
+    // keep drawing and undo steps in $XDG_RUNTIME_DIR across restarts
+    data->undo_journal_enabled = g_key_file_get_boolean (key_file, "General", "UndoJournal", NULL);
+    // trade CPU for memory of the undo steps
+    gchar *undo_codec = g_key_file_get_string (key_file, "General", "UndoCodec", NULL);
+    if(undo_codec && codec_by_name(undo_codec))
+	data->undo_codec = codec_by_name(undo_codec);
+    else if(undo_codec)
+	g_warning ("Unknown UndoCodec '%s', using '%s'", undo_codec, data->undo_codec->name);
+    g_free(undo_codec);
+    // every motion sample of high-rate pens, on X11 only
+    data->xi2_motion = g_key_file_get_boolean (key_file, "General", "XI2Motion", NULL);
+    // undo only reverts the strokes of the device it is triggered on
+    data->undo_per_device = g_key_file_get_boolean (key_file, "General", "UndoPerDevice", NULL);
+    if(data->undo_per_device && data->undo_engine == GROMIT_UNDO_COMMANDS)
+      {
+	g_warning ("UndoPerDevice needs UndoEngine 'tiles', ignoring it");
+	data->undo_per_device = FALSE;
+      }
 
  cleanup:
     g_free(filename);
@@ -743,6 +798,14 @@ void write_keyfile(GromitData *data)
 
     g_key_file_set_boolean (key_file, "General", "ShowIntroOnStartup", data->show_intro_on_startup);
     g_key_file_set_double (key_file, "Drawing", "Opacity", data->opacity);
+    g_key_file_set_integer (key_file, "General", "UndoMemoryMB", data->undo_budget >> 20);
+    g_key_file_set_string (key_file, "General", "UndoEngine",
+			   data->undo_engine == GROMIT_UNDO_COMMANDS ? "commands" : "tiles");
+    g_key_file_set_integer (key_file, "General", "UndoKeyframeInterval", data->undo_keyframe_interval);
+    g_key_file_set_boolean (key_file, "General", "UndoJournal", data->undo_journal_enabled);
+    g_key_file_set_boolean (key_file, "General", "UndoPerDevice", data->undo_per_device);
+    g_key_file_set_string (key_file, "General", "UndoCodec", data->undo_codec->name);
+    g_key_file_set_boolean (key_file, "General", "XI2Motion", data->xi2_motion);
 
     // if file exists but is read-only, bail out
     if (access(filename, F_OK) == 0 && access(filename, W_OK) != 0) {
@@ -460,14 +460,11 @@ static GList *build_section_list(GList *const coords,
 }
 
 void coord_list_prepend (GromitData *data, 
-			 GdkDevice* dev, 
+			 GromitDeviceData *devdata, 
 			 gint x, 
 			 gint y, 
 			 gint width)
 {
-  /* get the data for this device */
-  GromitDeviceData *devdata = g_hash_table_lookup(data->devdatatable, dev);
-
   GromitStrokeCoordinate *point;
 
   point = g_malloc (sizeof (GromitStrokeCoordinate));
@@ -480,11 +477,8 @@ void coord_list_prepend (GromitData *data,
 
 
 void coord_list_free (GromitData *data, 
-		      GdkDevice* dev)
+		      GromitDeviceData *devdata)
 {
-  /* get the data for this device */
-  GromitDeviceData *devdata = g_hash_table_lookup(data->devdatatable, dev);
-
   GList *ptr;
   ptr = devdata->coordlist;
 
@@ -499,12 +493,42 @@ void coord_list_free (GromitData *data,
   devdata->coordlist = NULL;
 }
 
+/*
+ * bounding box of all points including the stroke width
+ */
+void coord_list_get_extents (GList *coords,
+			     GdkRectangle *rect)
+{
+  gint x1 = G_MAXINT, y1 = G_MAXINT, x2 = G_MININT, y2 = G_MININT;
+
+  for (GList *ptr = coords; ptr; ptr = ptr->next)
+    {
+      GromitStrokeCoordinate *c = ptr->data;
+      gint r = c->width / 2 + 1;
+      x1 = MIN (x1, c->x - r);
+      y1 = MIN (y1, c->y - r);
+      x2 = MAX (x2, c->x + r);
+      y2 = MAX (y2, c->y + r);
+    }
+
+  if (!coords)
+    {
+      rect->x = rect->y = rect->width = rect->height = 0;
+      return;
+    }
+
+  rect->x = x1;
+  rect->y = y1;
+  rect->width = x2 - x1;
+  rect->height = y2 - y1;
+}
+
 /*
  * for double-ended arrows, two separate calls are required
  */
 
 gboolean coord_list_get_arrow_param (GromitData      *data,
-				     GdkDevice       *dev,
+				     GromitDeviceData *devdata,
 				     gint            search_radius,
                                      GromitArrowType arrow_end,
                                      gint            *x0,
@@ -515,8 +539,6 @@ gboolean coord_list_get_arrow_param (GromitData      *data,
   gint r2, dist;
   gboolean success = FALSE;
   GromitStrokeCoordinate  *cur_point, *valid_point;
-  /* get the data for this device */
-  GromitDeviceData *devdata = g_hash_table_lookup(data->devdatatable, dev);
   GList *ptr = devdata->coordlist;
   gfloat width;
 
@@ -28,15 +28,16 @@
 #include "main.h"
 
 gboolean coord_list_get_arrow_param (GromitData *data,
-				     GdkDevice  *dev,
+				     GromitDeviceData *devdata,
 				     gint        search_radius,
                                      GromitArrowType arrow_end,
                                      gint       *x0,
                                      gint       *y0,
 				     gint       *ret_width,
 				     gfloat     *ret_direction);
-void coord_list_prepend (GromitData *data, GdkDevice* dev, gint x, gint y, gint width);
-void coord_list_free (GromitData *data, GdkDevice* dev);
+void coord_list_prepend (GromitData *data, GromitDeviceData *devdata, gint x, gint y, gint width);
+void coord_list_free (GromitData *data, GromitDeviceData *devdata);
+void coord_list_get_extents (GList *coords, GdkRectangle *rect);
 gboolean snap_ends(GList *coords, gint max_distance);
 void orthogonalize(GList *coords, gint max_angular_deviation, gint min_ortho_len);
 void add_points(GList *coords, gfloat max_distance);
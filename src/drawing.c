@@ -2,14 +2,81 @@
 #include <math.h>
 #include "drawing.h"
 #include "main.h"
+#include "render.h"
+#include "undo.h"
+
+/*
+ * Damage 'rect' on behalf of 'devdata', which on_expose() needs to tell
+ * when the samples drawn there are on screen.
+ */
+static void device_damage (GromitData *data,
+			   GromitDeviceData *devdata,
+			   const GdkRectangle *rect)
+{
+  damage_add_rect(data, rect);
+
+  if (devdata->paint_time)
+    {
+      if (!devdata->paint_damage)
+	devdata->paint_damage = cairo_region_create ();
+      cairo_region_union_rectangle (devdata->paint_damage, rect);
+    }
+}
+
+
+void draw_capture_begin (GromitData *data,
+			 GromitDeviceData *devdata)
+{
+  draw_capture_end (devdata);
+  devdata->aux = tiled_surface_new (data->backbuffer->width, data->backbuffer->height);
+  devdata->aux_captured = g_new0 (guint8, tiled_surface_n_tiles (data->backbuffer));
+}
+
+
+/*
+ * Copy the tiles of 'rect' the stroke of 'devdata' has not drawn to yet,
+ * before it does.
+ */
+static void capture_area (GromitData *data,
+			  GromitDeviceData *devdata,
+			  const GdkRectangle *rect)
+{
+  if (devdata->aux)
+    tiled_surface_capture_area (data->backbuffer, devdata->aux, devdata->aux_captured, rect);
+}
+
+
+void draw_capture_restore (GromitData *data,
+			   GromitDeviceData *devdata,
+			   const GdkRectangle *area)
+{
+  if (!devdata->aux)
+    return;
+
+  undo_set_writer (data, devdata);
+  tiled_surface_restore_area (data->backbuffer, devdata->aux, devdata->aux_captured, area);
+  undo_set_writer (data, NULL);
+}
+
+
+void draw_capture_end (GromitDeviceData *devdata)
+{
+  if (!devdata->aux)
+    return;
+
+  tiled_surface_free (devdata->aux);
+  devdata->aux = NULL;
+  g_free (devdata->aux_captured);
+  devdata->aux_captured = NULL;
+}
+
 
 void draw_line (GromitData *data,
-		GdkDevice *dev,
+		GromitDeviceData *devdata,
 		gint x1, gint y1,
 		gint x2, gint y2)
 {
   GdkRectangle rect;
-  GromitDeviceData *devdata = g_hash_table_lookup(data->devdatatable, dev);
 
   rect.x = MIN (x1,x2) - data->maxwidth / 2;
   rect.y = MIN (y1,y2) - data->maxwidth / 2;
@@ -21,25 +88,76 @@ void draw_line (GromitData *data,
 
   if (devdata->cur_context->paint_ctx)
     {
-      cairo_set_line_width(devdata->cur_context->paint_ctx, data->maxwidth);
-      cairo_set_line_cap(devdata->cur_context->paint_ctx, CAIRO_LINE_CAP_ROUND);
-      cairo_set_line_join(devdata->cur_context->paint_ctx, CAIRO_LINE_JOIN_ROUND);
- 
-      cairo_move_to(devdata->cur_context->paint_ctx, x1, y1);
-      cairo_line_to(devdata->cur_context->paint_ctx, x2, y2);
-      cairo_stroke(devdata->cur_context->paint_ctx);
+      if (devdata->segments_context != devdata->cur_context)
+	draw_flush_segments(data, devdata);
+
+      capture_area(data, devdata, &rect);
+
+      if (!devdata->segments)
+	devdata->segments = g_array_new(FALSE, FALSE, sizeof(GromitStrokeSegment));
+
+      GromitStrokeSegment segment = { x1, y1, x2, y2, data->maxwidth };
+      g_array_append_val(devdata->segments, segment);
+      devdata->segments_context = devdata->cur_context;
 
       data->modified = 1;
 
-      gdk_window_invalidate_rect(gtk_widget_get_window(data->win), &rect, 0); 
+      device_damage(data, devdata, &rect);
+      undo_stroke_area(data, devdata, &rect);
+
+      if (!devdata->raster_time)
+	devdata->raster_time = devdata->draw_time;
     }
 
   data->painted = 1;
 }
 
 
+/*
+ * Corners of an arrowhead at (x1, y1) pointing in 'direction'.
+ */
+static void arrow_head (gint x1, gint y1,
+			gint width,
+			gfloat direction,
+			GdkPoint arrowhead[4])
+{
+  arrowhead [0].x = x1 + 4 * width * cos (direction);
+  arrowhead [0].y = y1 + 4 * width * sin (direction);
+
+  arrowhead [1].x = x1 - 3 * width * cos (direction)
+                       + 3 * width * sin (direction);
+  arrowhead [1].y = y1 - 3 * width * cos (direction)
+                       - 3 * width * sin (direction);
+
+  arrowhead [2].x = x1 - 2 * width * cos (direction);
+  arrowhead [2].y = y1 - 2 * width * sin (direction);
+
+  arrowhead [3].x = x1 - 3 * width * cos (direction)
+                       - 3 * width * sin (direction);
+  arrowhead [3].y = y1 + 3 * width * cos (direction)
+                       - 3 * width * sin (direction);
+}
+
+
+static void arrow_path (cairo_t *cr,
+			const GdkPoint arrowhead[4],
+			gboolean outline)
+{
+  cairo_set_line_width(cr, 1);
+  cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+  cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+
+  cairo_move_to(cr, arrowhead[0].x, arrowhead[0].y);
+  cairo_line_to(cr, arrowhead[1].x, arrowhead[1].y);
+  cairo_line_to(cr, arrowhead[2].x, arrowhead[2].y);
+  cairo_line_to(cr, arrowhead[3].x, arrowhead[3].y);
+  if (outline)
+    cairo_line_to(cr, arrowhead[0].x, arrowhead[0].y);
+}
+
+
 void draw_arrow (GromitData *data, 
-		 GdkDevice *dev,
+		 GromitDeviceData *devdata,
 		 gint x1, gint y1,
 		 gint width,
 		 gfloat direction)
@@ -47,8 +165,11 @@ void draw_arrow (GromitData *data,
   GdkRectangle rect;
   GdkPoint arrowhead [4];
 
-  /* get the data for this device */
-  GromitDeviceData *devdata = g_hash_table_lookup(data->devdatatable, dev);
+  /* the arrow goes on top of the line it ends */
+  draw_stroke_end(data, devdata);
+
+  if (devdata->cur_context->paint_ctx)
+    undo_log_arrow (data, devdata->cur_context, x1, y1, width, direction);
 
   width = width / 2;
 
@@ -58,50 +179,531 @@ void draw_arrow (GromitData *data,
   rect.width = 8 * width + 2;
   rect.height = 8 * width + 2;
 
-  arrowhead [0].x = x1 + 4 * width * cos (direction);
-  arrowhead [0].y = y1 + 4 * width * sin (direction);
-
-  arrowhead [1].x = x1 - 3 * width * cos (direction)
-                       + 3 * width * sin (direction);
-  arrowhead [1].y = y1 - 3 * width * cos (direction)
-                       - 3 * width * sin (direction);
-
-  arrowhead [2].x = x1 - 2 * width * cos (direction);
-  arrowhead [2].y = y1 - 2 * width * sin (direction);
-
-  arrowhead [3].x = x1 - 3 * width * cos (direction)
-                       - 3 * width * sin (direction);
-  arrowhead [3].y = y1 + 3 * width * cos (direction)
-                       - 3 * width * sin (direction);
+  arrow_head (x1, y1, width, direction, arrowhead);
 
   if (devdata->cur_context->paint_ctx)
     {
-      cairo_set_line_width(devdata->cur_context->paint_ctx, 1);
-      cairo_set_line_cap(devdata->cur_context->paint_ctx, CAIRO_LINE_CAP_ROUND);
-      cairo_set_line_join(devdata->cur_context->paint_ctx, CAIRO_LINE_JOIN_ROUND);
- 
-      cairo_move_to(devdata->cur_context->paint_ctx, arrowhead[0].x, arrowhead[0].y);
-      cairo_line_to(devdata->cur_context->paint_ctx, arrowhead[1].x, arrowhead[1].y);
-      cairo_line_to(devdata->cur_context->paint_ctx, arrowhead[2].x, arrowhead[2].y);
-      cairo_line_to(devdata->cur_context->paint_ctx, arrowhead[3].x, arrowhead[3].y);
-      cairo_fill(devdata->cur_context->paint_ctx);
+      capture_area (data, devdata, &rect);
+      undo_set_writer (data, devdata);
+      arrow_path (devdata->cur_context->paint_ctx, arrowhead, FALSE);
+      tiled_surface_fill(data->backbuffer, devdata->cur_context->paint_ctx);
 
       gdk_cairo_set_source_rgba(devdata->cur_context->paint_ctx, data->black);
 
-      cairo_move_to(devdata->cur_context->paint_ctx, arrowhead[0].x, arrowhead[0].y);
-      cairo_line_to(devdata->cur_context->paint_ctx, arrowhead[1].x, arrowhead[1].y);
-      cairo_line_to(devdata->cur_context->paint_ctx, arrowhead[2].x, arrowhead[2].y);
-      cairo_line_to(devdata->cur_context->paint_ctx, arrowhead[3].x, arrowhead[3].y);
-      cairo_line_to(devdata->cur_context->paint_ctx, arrowhead[0].x, arrowhead[0].y);
-      cairo_stroke(devdata->cur_context->paint_ctx);
+      arrow_path (devdata->cur_context->paint_ctx, arrowhead, TRUE);
+      tiled_surface_stroke(data->backbuffer, devdata->cur_context->paint_ctx);
+      undo_set_writer (data, NULL);
 
       gdk_cairo_set_source_rgba(devdata->cur_context->paint_ctx, devdata->cur_context->paint_color);
     
       data->modified = 1;
 
-      gdk_window_invalidate_rect(gtk_widget_get_window(data->win), &rect, 0); 
+      damage_add_rect(data, &rect);
+      undo_stroke_area(data, devdata, &rect);
     }
 
   data->painted = 1;
 }
 
+
+/*
+ * Add the edges of the LINE or RECT shape from (x0, y0) to (x1, y1) to the
+ * path of 'cr', the same way draw_preview_commit() draws them.
+ */
+static void preview_shape_path (cairo_t *cr,
+				GromitPaintType type,
+				gint x0, gint y0,
+				gint x1, gint y1)
+{
+  if (type == GROMIT_RECT)
+    {
+      cairo_move_to(cr, x0, y0);
+      cairo_line_to(cr, x1, y0);
+      cairo_move_to(cr, x1, y0);
+      cairo_line_to(cr, x1, y1);
+      cairo_move_to(cr, x1, y1);
+      cairo_line_to(cr, x0, y1);
+      cairo_move_to(cr, x0, y1);
+      cairo_line_to(cr, x0, y0);
+    }
+  else
+    {
+      cairo_move_to(cr, x0, y0);
+      cairo_line_to(cr, x1, y1);
+    }
+}
+
+
+/*
+ * Replace the preview of a device by a cleared surface covering 'rect'
+ * and return a context for drawing to it in screen coordinates with the
+ * color and current width of the tool.
+ */
+static cairo_t *preview_begin (GromitData *data,
+			       GromitDeviceData *devdata,
+			       const GdkRectangle *rect)
+{
+  GromitPaintContext *context = devdata->cur_context;
+
+  if (devdata->preview)
+    {
+      damage_add_rect(data, &devdata->preview_rect);
+      if (cairo_image_surface_get_width (devdata->preview) < rect->width ||
+	  cairo_image_surface_get_height (devdata->preview) < rect->height)
+	{
+	  cairo_surface_destroy (devdata->preview);
+	  devdata->preview = NULL;
+	}
+    }
+  if (!devdata->preview)
+    devdata->preview = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, rect->width, rect->height);
+
+  cairo_t *cr = cairo_create (devdata->preview);
+  cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+  cairo_paint (cr);
+  cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+  cairo_translate (cr, -rect->x, -rect->y);
+  cairo_set_antialias (cr, cairo_get_antialias (context->paint_ctx));
+
+  gdk_cairo_set_source_rgba (cr, context->paint_color);
+  cairo_set_line_width (cr, data->maxwidth);
+  cairo_set_line_cap (cr, CAIRO_LINE_CAP_ROUND);
+  cairo_set_line_join (cr, CAIRO_LINE_JOIN_ROUND);
+
+  return cr;
+}
+
+
+/*
+ * Show the LINE or RECT shape from the button press position to (x, y).
+ * The shape goes to a per-device preview surface covering only its
+ * bounding box, which on_expose() composites on top of the backbuffer.
+ */
+void draw_preview (GromitData *data,
+		   GromitDeviceData *devdata,
+		   gint x, gint y)
+{
+  GromitPaintContext *context = devdata->cur_context;
+  gint x0 = devdata->lastx, y0 = devdata->lasty;
+  gint arrow_width = 0;
+  GdkRectangle rect;
+
+  if (context->type == GROMIT_LINE && context->arrowsize > 0)
+    arrow_width = context->arrowsize * context->width / 2;
+
+  gint pad = MAX (data->maxwidth / 2, 4 * arrow_width) + 2;
+  rect.x = MIN (x0, x) - pad;
+  rect.y = MIN (y0, y) - pad;
+  rect.width = ABS (x0 - x) + 2 * pad;
+  rect.height = ABS (y0 - y) + 2 * pad;
+
+  cairo_t *cr = preview_begin (data, devdata, &rect);
+  preview_shape_path (cr, context->type, x0, y0, x, y);
+  cairo_stroke (cr);
+
+  if (arrow_width > 0)
+    {
+      GdkPoint arrowhead [4];
+      gfloat direction = atan2 (y - y0, x - x0);
+
+      for (int end = 0; end < 2; end++)
+	{
+	  if (end == 0 && !(context->arrow_type & GROMIT_ARROW_END))
+	    continue;
+	  if (end == 1 && !(context->arrow_type & GROMIT_ARROW_START))
+	    continue;
+
+	  if (end == 0)
+	    arrow_head (x, y, arrow_width, direction, arrowhead);
+	  else
+	    arrow_head (x0, y0, arrow_width, M_PI + direction, arrowhead);
+
+	  gdk_cairo_set_source_rgba (cr, context->paint_color);
+	  arrow_path (cr, arrowhead, FALSE);
+	  cairo_fill (cr);
+	  gdk_cairo_set_source_rgba (cr, data->black);
+	  arrow_path (cr, arrowhead, TRUE);
+	  cairo_stroke (cr);
+	}
+    }
+
+  cairo_destroy (cr);
+
+  devdata->preview_rect = rect;
+  devdata->preview_x = x;
+  devdata->preview_y = y;
+  devdata->preview_width = data->maxwidth;
+
+  data->modified = 1;
+  device_damage(data, devdata, &rect);
+}
+
+
+/*
+ * Show where the freehand stroke most likely goes next, the segment from
+ * the last drawn position to the predicted one (x, y), on the preview
+ * surface. The next call replaces it, so it never reaches the backbuffer.
+ */
+void draw_prediction (GromitData *data,
+		      GromitDeviceData *devdata,
+		      gdouble x, gdouble y)
+{
+  gdouble x0 = devdata->lastx, y0 = devdata->lasty;
+  GdkRectangle rect;
+
+  gint pad = data->maxwidth / 2 + 2;
+  rect.x = floor (MIN (x0, x)) - pad;
+  rect.y = floor (MIN (y0, y)) - pad;
+  rect.width = ceil (ABS (x0 - x)) + 2 * pad + 1;
+  rect.height = ceil (ABS (y0 - y)) + 2 * pad + 1;
+
+  cairo_t *cr = preview_begin (data, devdata, &rect);
+  cairo_move_to (cr, x0, y0);
+  cairo_line_to (cr, x, y);
+  cairo_stroke (cr);
+  cairo_destroy (cr);
+
+  devdata->preview_rect = rect;
+  devdata->preview_x = x;
+  devdata->preview_y = y;
+  devdata->preview_width = data->maxwidth;
+
+  data->modified = 1;
+  device_damage(data, devdata, &rect);
+}
+
+
+/*
+ * Draw the previewed shape to the backbuffer and drop the preview. A
+ * predicted stroke segment is only dropped.
+ */
+void draw_preview_commit (GromitData *data,
+			  GromitDeviceData *devdata)
+{
+  if (!devdata->preview)
+    return;
+
+  if (!devdata->cur_context)
+    {
+      draw_preview_cancel (data, devdata);
+      return;
+    }
+
+  GromitPaintType type = devdata->cur_context->type;
+  if (type != GROMIT_LINE && type != GROMIT_RECT)
+    {
+      draw_preview_cancel (data, devdata);
+      return;
+    }
+
+  gint x0 = devdata->lastx, y0 = devdata->lasty;
+  gint x1 = devdata->preview_x, y1 = devdata->preview_y;
+
+  data->maxwidth = devdata->preview_width;
+  if (devdata->cur_context->type == GROMIT_RECT)
+    {
+      draw_line (data, devdata, x0, y0, x1, y0);
+      draw_line (data, devdata, x1, y0, x1, y1);
+      draw_line (data, devdata, x1, y1, x0, y1);
+      draw_line (data, devdata, x0, y1, x0, y0);
+    }
+  else
+    draw_line (data, devdata, x0, y0, x1, y1);
+
+  draw_preview_cancel (data, devdata);
+}
+
+
+void draw_preview_cancel (GromitData *data,
+			  GromitDeviceData *devdata)
+{
+  if (!devdata->preview)
+    return;
+
+  damage_add_rect(data, &devdata->preview_rect);
+  cairo_surface_destroy (devdata->preview);
+  devdata->preview = NULL;
+  data->modified = 1;
+}
+
+
+/*
+ * Append the outline of a stroke through 'coords' with per-point width to
+ * the path of 'ctx'. Every segment becomes the convex hull of the circles
+ * around its end points. All subpaths have the same orientation, so
+ * filling them with the nonzero rule covers each pixel exactly once.
+ */
+void draw_stroke_outline (cairo_t *ctx,
+			  const GromitStrokeCoordinate *coords,
+			  guint n)
+{
+  for (guint i = 0; i < n; i++)
+    {
+      gdouble r1 = coords[i].width / 2.0;
+
+      if (r1 > 0)
+	{
+	  cairo_new_sub_path(ctx);
+	  cairo_arc(ctx, coords[i].x, coords[i].y, r1, 0, 2 * M_PI);
+	}
+
+      if (i + 1 == n)
+	break;
+
+      gdouble r2 = coords[i + 1].width / 2.0;
+      gdouble dx = coords[i + 1].x - coords[i].x;
+      gdouble dy = coords[i + 1].y - coords[i].y;
+      gdouble len = sqrt (dx * dx + dy * dy);
+
+      /* one circle contains the other, nothing to connect */
+      if (len <= fabs (r1 - r2))
+	continue;
+
+      dx /= len;
+      dy /= len;
+
+      /* directions from the centers to the outer tangent points */
+      gdouble a = (r1 - r2) / len;
+      gdouble b = sqrt (1 - a * a);
+      gdouble n1x = a * dx - b * dy, n1y = a * dy + b * dx;
+      gdouble n2x = a * dx + b * dy, n2y = a * dy - b * dx;
+
+      gdouble px[4] = { coords[i].x + r1 * n1x, coords[i + 1].x + r2 * n1x,
+			coords[i + 1].x + r2 * n2x, coords[i].x + r1 * n2x };
+      gdouble py[4] = { coords[i].y + r1 * n1y, coords[i + 1].y + r2 * n1y,
+			coords[i + 1].y + r2 * n2y, coords[i].y + r1 * n2y };
+
+      /* same orientation as cairo_arc() with increasing angles */
+      gdouble area = 0;
+      for (int k = 0; k < 4; k++)
+	area += px[k] * py[(k + 1) % 4] - px[(k + 1) % 4] * py[k];
+
+      cairo_move_to(ctx, px[0], py[0]);
+      if (area > 0)
+	for (int k = 1; k < 4; k++)
+	  cairo_line_to(ctx, px[k], py[k]);
+      else
+	for (int k = 3; k > 0; k--)
+	  cairo_line_to(ctx, px[k], py[k]);
+      cairo_close_path(ctx);
+    }
+}
+
+
+/*
+ * Tessellate connected runs of pending segments and fill them all at once
+ * to 'target'. A run tapers from the width of one segment to that of the
+ * next.
+ */
+static void flush_segments_filled (GromitTiledSurface *target,
+				   cairo_t *ctx,
+				   const GromitStrokeSegment *segments,
+				   guint n)
+{
+  GromitStrokeCoordinate *coords = g_new (GromitStrokeCoordinate, 2 * n);
+  guint len = 0;
+
+  for (guint i = 0; i < n; i++)
+    {
+      if (len == 0 || segments[i].x1 != coords[len - 1].x || segments[i].y1 != coords[len - 1].y)
+	{
+	  draw_stroke_outline(ctx, coords, len);
+	  len = 0;
+	  coords[len].x = segments[i].x1;
+	  coords[len].y = segments[i].y1;
+	  coords[len].width = segments[i].width;
+	  len++;
+	}
+      coords[len].x = segments[i].x2;
+      coords[len].y = segments[i].y2;
+      coords[len].width = segments[i].width;
+      len++;
+    }
+  draw_stroke_outline(ctx, coords, len);
+
+  cairo_set_fill_rule(ctx, CAIRO_FILL_RULE_WINDING);
+  tiled_surface_fill(target, ctx);
+
+  g_free (coords);
+}
+
+
+/*
+ * Whether pen strokes of 'context' are collected on a layer of their own.
+ * The outlines filled in consecutive frames overlap at the point where
+ * they meet, a translucent color would show twice there.
+ */
+static gboolean stroke_is_layered (GromitPaintContext *context)
+{
+  return (context->type == GROMIT_PEN || context->type == GROMIT_SMOOTH) &&
+    context->paint_color->alpha < 1.0 &&
+    cairo_get_operator (context->paint_ctx) == CAIRO_OPERATOR_OVER;
+}
+
+
+/*
+ * Fill pending segments of a translucent stroke to the stroke layer of the
+ * device, in the opaque color. Overlapping outlines only add coverage
+ * there, the alpha is applied once by stroke_commit().
+ */
+static void flush_segments_layered (GromitData *data,
+				    GromitDeviceData *devdata,
+				    const GromitStrokeSegment *segments,
+				    guint n)
+{
+  GromitPaintContext *context = devdata->segments_context;
+  cairo_t *ctx = context->paint_ctx;
+  GdkRGBA *color = context->paint_color;
+
+  if (!devdata->stroke)
+    {
+      devdata->stroke = tiled_surface_new (data->backbuffer->width, data->backbuffer->height);
+      devdata->stroke_context = context;
+      devdata->stroke_alpha = color->alpha;
+    }
+
+  cairo_save (ctx);
+  cairo_set_source_rgb (ctx, color->red, color->green, color->blue);
+  flush_segments_filled (devdata->stroke, ctx, segments, n);
+  cairo_restore (ctx);
+}
+
+
+/*
+ * Paint the stroke layer of a device to the backbuffer with the alpha of
+ * the stroke's color and drop it.
+ */
+static void stroke_commit (GromitData *data,
+			   GromitDeviceData *devdata)
+{
+  if (!devdata->stroke)
+    return;
+
+  undo_set_writer (data, devdata);
+  tiled_surface_composite (data->backbuffer, devdata->stroke, devdata->stroke_alpha);
+  undo_set_writer (data, NULL);
+
+  tiled_surface_free (devdata->stroke);
+  devdata->stroke = NULL;
+  devdata->stroke_context = NULL;
+}
+
+
+/*
+ * Segments of the same width go into one path, connected ones as a
+ * polyline, so that there is one stroke per width instead of one per
+ * segment and no overlapping caps.
+ */
+static void flush_segments_stroked (GromitTiledSurface *target,
+				    cairo_t *ctx,
+				    const GromitStrokeSegment *segments,
+				    guint n)
+{
+  gboolean *done = g_new0 (gboolean, n);
+
+  cairo_set_line_cap(ctx, CAIRO_LINE_CAP_ROUND);
+  cairo_set_line_join(ctx, CAIRO_LINE_JOIN_ROUND);
+
+  for (guint i = 0; i < n; i++)
+    {
+      if (done[i])
+	continue;
+
+      guint width = segments[i].width;
+      gboolean connected = FALSE;
+      gint lastx = 0, lasty = 0;
+
+      for (guint j = i; j < n; j++)
+	{
+	  if (done[j] || segments[j].width != width)
+	    {
+	      connected = FALSE;
+	      continue;
+	    }
+	  if (!connected || segments[j].x1 != lastx || segments[j].y1 != lasty)
+	    cairo_move_to(ctx, segments[j].x1, segments[j].y1);
+	  cairo_line_to(ctx, segments[j].x2, segments[j].y2);
+	  lastx = segments[j].x2;
+	  lasty = segments[j].y2;
+	  connected = TRUE;
+	  done[j] = TRUE;
+	}
+
+      cairo_set_line_width(ctx, width);
+      tiled_surface_stroke(target, ctx);
+    }
+
+  g_free (done);
+}
+
+
+/*
+ * Rasterize the pending segments of a device. Pen strokes are filled as
+ * one outline, the other tools stroked per width.
+ */
+void draw_flush_segments (GromitData *data,
+			  GromitDeviceData *devdata)
+{
+  if (!devdata->segments || devdata->segments->len == 0)
+    return;
+
+  /* a stroke in another color or tool ends the translucent one */
+  if (devdata->stroke && devdata->stroke_context != devdata->segments_context)
+    stroke_commit (data, devdata);
+
+  GromitStrokeSegment *segments = (GromitStrokeSegment *) devdata->segments->data;
+  guint n = devdata->segments->len;
+  cairo_t *ctx = devdata->segments_context->paint_ctx;
+  GromitPaintType type = devdata->segments_context->type;
+
+  undo_log_segments (data, devdata->segments_context, segments, n);
+
+  if (stroke_is_layered (devdata->segments_context))
+    flush_segments_layered (data, devdata, segments, n);
+  else
+    {
+      undo_set_writer (data, devdata);
+      if (type == GROMIT_PEN || type == GROMIT_SMOOTH)
+	flush_segments_filled (data->backbuffer, ctx, segments, n);
+      else
+	flush_segments_stroked (data->backbuffer, ctx, segments, n);
+      undo_set_writer (data, NULL);
+    }
+  g_array_set_size(devdata->segments, 0);
+
+  if (devdata->raster_time)
+    {
+      latency_record (&devdata->latency, GROMIT_LATENCY_RASTER, devdata->raster_time);
+      devdata->raster_time = 0;
+    }
+}
+
+
+void draw_stroke_end (GromitData *data,
+		      GromitDeviceData *devdata)
+{
+  draw_flush_segments(data, devdata);
+  stroke_commit(data, devdata);
+}
+
+
+void draw_flush_frame (GromitData *data)
+{
+  GHashTableIter it;
+  gpointer value;
+
+  g_hash_table_iter_init (&it, data->devdatatable);
+  while (g_hash_table_iter_next (&it, NULL, &value))
+    draw_flush_segments(data, value);
+}
+
+
+void draw_flush_all (GromitData *data)
+{
+  GHashTableIter it;
+  gpointer value;
+
+  g_hash_table_iter_init (&it, data->devdatatable);
+  while (g_hash_table_iter_next (&it, NULL, &value))
+    draw_stroke_end(data, value);
+}
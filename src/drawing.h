@@ -15,8 +15,46 @@ typedef struct
   gint width;
 } GromitStrokeCoordinate;
 
+typedef struct
+{
+  gint x1;
+  gint y1;
+  gint x2;
+  gint y2;
+  guint width;
+} GromitStrokeSegment;
+
+
+void draw_line (GromitData *data, GromitDeviceData *devdata, gint x1, gint y1, gint x2, gint y2);
+void draw_arrow (GromitData *data, GromitDeviceData *devdata, gint x1, gint y1, gint width, gfloat direction);
+void draw_stroke_outline (cairo_t *ctx, const GromitStrokeCoordinate *coords, guint n);
+
+/*
+  SMOOTH and ORTHOGONAL redraw the stroke on button release over what was
+  there before. Each device keeps the tiles its stroke draws to, as they
+  were before the first draw_line() or draw_arrow() on them.
+*/
+void draw_capture_begin (GromitData *data, GromitDeviceData *devdata);
+void draw_capture_restore (GromitData *data, GromitDeviceData *devdata, const GdkRectangle *area);
+void draw_capture_end (GromitDeviceData *devdata);
+
+/* in-progress LINE and RECT shapes, committed on button release */
+void draw_preview (GromitData *data, GromitDeviceData *devdata, gint x, gint y);
+void draw_prediction (GromitData *data, GromitDeviceData *devdata, gdouble x, gdouble y);
+void draw_preview_commit (GromitData *data, GromitDeviceData *devdata);
+void draw_preview_cancel (GromitData *data, GromitDeviceData *devdata);
 
-void draw_line (GromitData *data, GdkDevice *dev, gint x1, gint y1, gint x2, gint y2);
-void draw_arrow (GromitData *data, GdkDevice *dev, gint x1, gint y1, gint width, gfloat direction);
+/*
+  draw_line() only collects segments, these rasterize them. Called once per
+  frame and before anything that reads the backbuffer or changes contexts.
+  Translucent pen strokes are rasterized to a layer of the device first,
+  see GromitDeviceData.stroke, and only reach the backbuffer when they end:
+  draw_flush_segments() and draw_flush_frame() leave them there,
+  draw_stroke_end() and draw_flush_all() complete them.
+*/
+void draw_flush_segments (GromitData *data, GromitDeviceData *devdata);
+void draw_stroke_end (GromitData *data, GromitDeviceData *devdata);
+void draw_flush_frame (GromitData *data);
+void draw_flush_all (GromitData *data);
 
 #endif
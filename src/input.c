@@ -13,6 +13,10 @@
 #include <gdk/gdkwayland.h>
 #endif
 #include "callbacks.h"
+#include "coordlist_ops.h"
+#include "drawing.h"
+#include "render.h"
+#include "undo.h"
 
 #define WAYLAND_HOTKEY_PREFIX "gromit-mpx-wayland-hotkey"
 
@@ -218,18 +222,102 @@ static void add_hotkeys_to_compositor(GromitData *data) {
     }
 }
 
+/*
+ * Device registry. The data of a device is kept across hotplug events, so
+ * a GromitDeviceData pointer stays valid for as long as its device is
+ * there. GDK events find it by device once per event, raw XI2 events by
+ * XI2 id in a dense array, see devices_lookup_id().
+ */
+static void devices_register (GromitData *data,
+			      GromitDeviceData *devdata)
+{
+  g_hash_table_insert(data->devdatatable, devdata->device, devdata);
+
+  if (data->devices_by_id && devdata->xi2_id >= 0)
+    {
+      if ((guint) devdata->xi2_id >= data->devices_by_id->len)
+	g_ptr_array_set_size(data->devices_by_id, devdata->xi2_id + 1);
+      g_ptr_array_index(data->devices_by_id, devdata->xi2_id) = devdata;
+    }
+}
+
+
+/*
+ * Draw everything still pending for a device.
+ */
+void devices_flush (GromitData *data,
+		    GromitDeviceData *devdata)
+{
+  process_motion(data, devdata);
+  draw_preview_commit(data, devdata);
+  draw_stroke_end(data, devdata);
+}
+
+
+static void devices_free (GromitData *data,
+			  GromitDeviceData *devdata)
+{
+  if (data->devices_by_id && devdata->xi2_id >= 0 &&
+      (guint) devdata->xi2_id < data->devices_by_id->len &&
+      g_ptr_array_index(data->devices_by_id, devdata->xi2_id) == devdata)
+    g_ptr_array_index(data->devices_by_id, devdata->xi2_id) = NULL;
+
+  devices_flush(data, devdata);
+  undo_forget_device(data, devdata);
+  coord_list_free(data, devdata);
+  if (devdata->motion)
+    g_array_free(devdata->motion, TRUE);
+  if (devdata->segments)
+    g_array_free(devdata->segments, TRUE);
+  if (devdata->paint_damage)
+    cairo_region_destroy(devdata->paint_damage);
+  draw_capture_end(devdata);
+  g_free(devdata);
+}
+
+
+GromitDeviceData *devices_lookup (GromitData *data,
+				  GdkDevice *device)
+{
+  if (!device)
+    return NULL;
+
+  /*
+    A direct hash of the pointer, cheaper than asking GDK for the XI2 id
+    of the device first.
+  */
+  return g_hash_table_lookup(data->devdatatable, device);
+}
+
+
+GromitDeviceData *devices_lookup_id (GromitData *data,
+				     gint xi2_id)
+{
+  if (!data->devices_by_id || xi2_id < 0 || (guint) xi2_id >= data->devices_by_id->len)
+    return NULL;
+  return g_ptr_array_index(data->devices_by_id, xi2_id);
+}
+
+
 void setup_input_devices (GromitData *data)
 {
   /* ungrab all */
   release_grab (data, NULL); 
 
-  /* and clear our own device data list */
-  GHashTableIter it;
-  gpointer value;
-  g_hash_table_iter_init (&it, data->devdatatable);
-  while (g_hash_table_iter_next (&it, NULL, &value)) 
-    g_free(value);
-  g_hash_table_remove_all(data->devdatatable);
+  /* the tool configuration or the devices changed */
+  if (data->tool_cache)
+    g_hash_table_remove_all (data->tool_cache);
+
+  /*
+    start over with an empty registry, the data of devices that are still
+    there is taken over from the old one below
+  */
+  GHashTable *old_devdatatable = data->devdatatable;
+  data->devdatatable = g_hash_table_new(NULL, NULL);
+  if (data->devices_by_id)
+    g_ptr_array_set_size(data->devices_by_id, 0);
+  else if (GDK_IS_X11_DISPLAY(data->display))
+    data->devices_by_id = g_ptr_array_new();
 
 
   /* get devices */
@@ -247,11 +335,30 @@ void setup_input_devices (GromitData *data)
         {
           gdk_device_set_mode (device, GDK_MODE_SCREEN);
 
-          GromitDeviceData *devdata;
-
-          devdata  = g_malloc0(sizeof (GromitDeviceData));
-          devdata->device = device;
+          GromitDeviceData *devdata = g_hash_table_lookup(old_devdatatable, device);
+
+          if (devdata)
+            {
+              g_hash_table_steal(old_devdatatable, device);
+              /* pending samples and shapes belong to the old tool */
+              devices_flush(data, devdata);
+              /* make the next event select the tool again */
+              devdata->cur_context = NULL;
+              devdata->state = 0;
+              devdata->lastslave = NULL;
+              devdata->xi2_source = 0;
+            }
+          else
+            {
+              devdata = g_malloc0(sizeof (GromitDeviceData));
+              devdata->device = device;
+            }
           devdata->index = i;
+          devdata->xi2_id = -1;
+#ifdef GDK_WINDOWING_X11
+          if (GDK_IS_X11_DISPLAY(data->display))
+            devdata->xi2_id = gdk_x11_device_get_id(device);
+#endif
 
 	  /* get attached keyboard and grab the hotkey */
 	  if (GDK_IS_X11_DISPLAY(data->display)) {
@@ -343,7 +450,7 @@ void setup_input_devices (GromitData *data)
 			  {
 			      g_printerr("ERROR: Grabbing keys from keyboard device %d failed due to X11 error.\n",
 					 kbd_dev_id);
-			      g_free(devdata);
+			      devices_free(data, devdata);
 			      continue;
 			  }
 		  }
@@ -359,15 +466,165 @@ void setup_input_devices (GromitData *data)
 	      add_hotkeys_to_compositor(data);
           }
 
-          g_hash_table_insert(data->devdatatable, device, devdata);
+          devices_register(data, devdata);
           g_printerr ("Enabled Device %d: \"%s\", (Type: %d)\n", 
 		      i++, gdk_device_get_name(device), gdk_device_get_source(device));
         }
     }
 
+  /* what is left are devices that went away */
+  GHashTableIter it;
+  gpointer value;
+  g_hash_table_iter_init (&it, old_devdatatable);
+  while (g_hash_table_iter_next (&it, NULL, &value))
+    devices_free(data, value);
+  g_hash_table_destroy(old_devdatatable);
+
   g_printerr ("Now %d enabled devices.\n", g_hash_table_size(data->devdatatable));
 }
 
+#ifdef GDK_WINDOWING_X11
+/*
+ * Look up the pressure valuator of slave 'sourceid' of 'devdata'.
+ */
+static void xi2_find_pressure (GromitData *data,
+			       GromitDeviceData *devdata,
+			       gint sourceid)
+{
+  Display *dpy = GDK_DISPLAY_XDISPLAY(data->display);
+  Atom label = XInternAtom(dpy, "Abs Pressure", True);
+  int n = 0;
+  XIDeviceInfo *info = XIQueryDevice(dpy, sourceid, &n);
+
+  devdata->xi2_source = sourceid;
+  devdata->xi2_pressure = -1;
+  devdata->xi2_last_pressure = 1;
+  for (int i = 0; n > 0 && label != None && i < info->num_classes; i++)
+    {
+      XIValuatorClassInfo *v = (XIValuatorClassInfo *) info->classes[i];
+      if (v->type == XIValuatorClass && v->label == label && v->max > v->min)
+	{
+	  devdata->xi2_pressure = v->number;
+	  devdata->xi2_pressure_min = v->min;
+	  devdata->xi2_pressure_max = v->max;
+	}
+    }
+  if (info)
+    XIFreeDeviceInfo(info);
+}
+
+
+/*
+ * Queue XI_Motion events of grabbed devices as motion samples right away,
+ * the way on_motion() does, without GDK translating them into events.
+ */
+static GdkFilterReturn on_xi2_event (GdkXEvent *gdk_xevent,
+				     GdkEvent *event,
+				     gpointer user_data)
+{
+  GromitData *data = (GromitData *) user_data;
+  XGenericEventCookie *cookie = &((XEvent *) gdk_xevent)->xcookie;
+
+  /* GDK fetched the cookie data already */
+  if (cookie->type != GenericEvent || cookie->extension != data->xi2_opcode ||
+      cookie->evtype != XI_Motion || !cookie->data)
+    return GDK_FILTER_CONTINUE;
+
+  XIDeviceEvent *xev = cookie->data;
+  GromitDeviceData *devdata = devices_lookup_id(data, xev->deviceid);
+
+  if (!devdata || !devdata->is_grabbed || data->started_from_gui ||
+      xev->event != GDK_WINDOW_XID(gtk_widget_get_window(data->win)))
+    return GDK_FILTER_CONTINUE;
+
+  /* the state GDK would report */
+  guint state = xev->mods.effective | (xev->group.effective & 3) << 13;
+  for (gint b = 1; b <= 5 && b < xev->buttons.mask_len * 8; b++)
+    if (XIMaskIsSet(xev->buttons.mask, b))
+      state |= 1 << (b + 7);
+
+  /* hover, GDK drops it because of GDK_BUTTON_MOTION_MASK */
+  if (!(state & (GDK_BUTTON1_MASK | GDK_BUTTON2_MASK | GDK_BUTTON3_MASK |
+		 GDK_BUTTON4_MASK | GDK_BUTTON5_MASK)))
+    return GDK_FILTER_CONTINUE;
+
+  GdkDevice *slave = gdk_x11_device_manager_lookup(gdk_display_get_device_manager(data->display),
+						   xev->sourceid);
+  if (state != devdata->state || slave != devdata->lastslave)
+    {
+      /* queued samples belong to the old tool */
+      process_motion(data, devdata);
+      select_tool(data, devdata->device, slave, state);
+    }
+
+  if (xev->sourceid != devdata->xi2_source)
+    xi2_find_pressure(data, devdata, xev->sourceid);
+
+  /* valuators that did not change are left out, values has the others in order */
+  gint p = devdata->xi2_pressure;
+  if (p >= 0 && p < xev->valuators.mask_len * 8 && XIMaskIsSet(xev->valuators.mask, p))
+    {
+      gint k = 0;
+      for (gint i = 0; i < p; i++)
+	if (XIMaskIsSet(xev->valuators.mask, i))
+	  k++;
+      devdata->xi2_last_pressure = (xev->valuators.values[k] - devdata->xi2_pressure_min) /
+	(devdata->xi2_pressure_max - devdata->xi2_pressure_min);
+    }
+
+  /* in device pixels, GDK works in logical ones */
+  gint scale = gdk_window_get_scale_factor(gtk_widget_get_window(data->win));
+  GromitMotionSample sample;
+  sample.x = xev->event_x / scale;
+  sample.y = xev->event_y / scale;
+  sample.pressure = devdata->motion_time == 0 ? 0 : devdata->xi2_last_pressure;
+  sample.history = FALSE;
+  sample.time = xev->time;
+  latency_record(&devdata->latency, GROMIT_LATENCY_RECEIVE, xev->time);
+
+  if (!devdata->motion)
+    devdata->motion = g_array_new(FALSE, FALSE, sizeof(GromitMotionSample));
+  g_array_append_val(devdata->motion, sample);
+  devdata->motion_time = xev->time;
+
+  render_request_frame(data);
+
+  return GDK_FILTER_REMOVE;
+}
+#endif
+
+
+/*
+ * Optional input backend for high-rate pens: the X server sends an
+ * XI_Motion event for every sample, while GDK compresses motion events and
+ * gdk_device_get_history() does not work with several monitors. Taking the
+ * samples from the XI2 events directly keeps all of them.
+ */
+void setup_xi2_motion (GromitData *data)
+{
+#ifdef GDK_WINDOWING_X11
+  int event, error;
+
+  if (!GDK_IS_X11_DISPLAY(data->display) ||
+      !XQueryExtension(GDK_DISPLAY_XDISPLAY(data->display), "XInputExtension",
+		       &data->xi2_opcode, &event, &error))
+    {
+      g_printerr("XI2 motion needs XInput 2 on X11, using GDK motion events.\n");
+      data->xi2_motion = FALSE;
+      return;
+    }
+
+  /* GDK already selects XI_Motion on our window and grabs with it */
+  gdk_window_add_filter(NULL, on_xi2_event, data);
+
+  if(data->debug)
+    g_printerr("DEBUG: Taking motion from XI2 events.\n");
+#else
+  data->xi2_motion = FALSE;
+#endif
+}
+
+
 void shutdown_input_devices(GromitData *data)
 {
     release_grab(data, NULL); /* ungrab all */
@@ -413,6 +670,7 @@ void release_grab (GromitData *data,
 	      g_printerr("WARNING: Ungrabbing device '%s' failed.\n", gdk_device_get_name(devdata->device));
 
 	    devdata->is_grabbed = 0;
+	    devdata->grab_cursor = NULL;
             /* workaround buggy GTK3 ? */
 	    devdata->motion_time = 0;
 	  }
@@ -431,12 +689,13 @@ void release_grab (GromitData *data,
 
 
   /* get the data for this device */
-  GromitDeviceData *devdata = g_hash_table_lookup(data->devdatatable, dev);
+  GromitDeviceData *devdata = devices_lookup(data, dev);
 
   if (devdata->is_grabbed)
     {
       gdk_device_ungrab(devdata->device, GDK_CURRENT_TIME);
       devdata->is_grabbed = 0;
+      devdata->grab_cursor = NULL;
       /* workaround buggy GTK3 ? */
       devdata->motion_time = 0;
 
@@ -510,6 +769,7 @@ void acquire_grab (GromitData *data,
 	    }
 	   
           devdata->is_grabbed = 1;
+          devdata->grab_cursor = cursor;
         }
 
       if(data->debug)
@@ -522,7 +782,7 @@ void acquire_grab (GromitData *data,
 
 
   /* get the data for this device */
-  GromitDeviceData *devdata = g_hash_table_lookup(data->devdatatable, dev);
+  GromitDeviceData *devdata = devices_lookup(data, dev);
 
   if (!devdata->is_grabbed)
     {
@@ -549,6 +809,7 @@ void acquire_grab (GromitData *data,
 	}
 
       devdata->is_grabbed = 1;
+      devdata->grab_cursor = cursor;
       
       if(data->debug)
         g_printerr("DEBUG: Grabbed Device '%s'.\n", gdk_device_get_name(devdata->device));
@@ -573,7 +834,7 @@ void toggle_grab (GromitData *data,
     }
   g_print("toggle_grab");
   /* get the data for this device */
-  GromitDeviceData *devdata = g_hash_table_lookup(data->devdatatable, dev);
+  GromitDeviceData *devdata = devices_lookup(data, dev);
   g_print("after g_hash");
   if(devdata)
     {
@@ -639,10 +900,12 @@ gint snoop_key_press(GtkWidget   *grab_widget,
 	  }
       if (data->hidden)
         return FALSE;
+      /* the pointer paired with this keyboard, for per device undo */
+      GromitDeviceData *devdata = devices_lookup(data, gdk_device_get_associated_device(dev));
       if (event->state & GDK_SHIFT_MASK)
-        redo_drawing (data);
+        redo_drawing (data, devdata);
       else
-        undo_drawing (data);
+        undo_drawing (data, devdata);
 
       return TRUE;
     }
@@ -6,7 +6,11 @@
 #include "main.h"
 
 void setup_input_devices (GromitData *data);
+GromitDeviceData *devices_lookup (GromitData *data, GdkDevice *device);
+GromitDeviceData *devices_lookup_id (GromitData *data, gint xi2_id);
+void devices_flush (GromitData *data, GromitDeviceData *devdata);
 void shutdown_input_devices (GromitData *data);
+void setup_xi2_motion (GromitData *data);
 void release_grab (GromitData *data, GdkDevice *dev);
 void acquire_grab (GromitData *data, GdkDevice *dev);
 void toggle_grab  (GromitData *data, GdkDevice *dev);
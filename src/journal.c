@@ -0,0 +1,222 @@
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include "journal.h"
+
+#define JOURNAL_MAGIC "GROMITJ1"
+#define JOURNAL_MAGIC_LEN 8
+/* the file grows in steps of at least this */
+#define JOURNAL_CHUNK (4 << 20)
+
+struct _GromitJournal
+{
+  int      fd;
+  gchar   *path;
+  guchar  *map;
+  gsize    mapped;
+  /* end of the last complete record */
+  gsize    used;
+  /* record being appended */
+  gsize    pending;
+};
+
+typedef struct
+{
+  guint32 length;
+  guint32 type;
+} RecordHeader;
+
+
+static gsize record_size (guint32 length)
+{
+  return sizeof (RecordHeader) + ((length + 7) & ~(gsize) 7);
+}
+
+
+static gboolean journal_map (GromitJournal *j, gsize size)
+{
+  if (j->map)
+    munmap (j->map, j->mapped);
+  j->map = NULL;
+  j->mapped = 0;
+
+  if (ftruncate (j->fd, size) != 0)
+    return FALSE;
+
+  void *map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, j->fd, 0);
+  if (map == MAP_FAILED)
+    return FALSE;
+
+  j->map = map;
+  j->mapped = size;
+  return TRUE;
+}
+
+
+static GromitJournal *journal_new (const gchar *path, int fd)
+{
+  GromitJournal *j = g_new0 (GromitJournal, 1);
+  j->fd = fd;
+  j->path = g_strdup (path);
+  return j;
+}
+
+
+GromitJournal *journal_open (const gchar *path)
+{
+  int fd = g_open (path, O_RDWR | O_CLOEXEC, 0);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat (fd, &st) != 0 || st.st_size < JOURNAL_MAGIC_LEN)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  GromitJournal *j = journal_new (path, fd);
+  if (!journal_map (j, st.st_size) || memcmp (j->map, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0)
+    {
+      g_warning ("Ignoring invalid journal %s", path);
+      journal_close (j);
+      return NULL;
+    }
+
+  /* find the end of the complete records */
+  gsize offset = 0;
+  guint32 type, length;
+  const guchar *payload;
+  while (journal_next (j, &offset, &type, &payload, &length))
+    ;
+  j->used = offset;
+  j->pending = offset;
+
+  return j;
+}
+
+
+GromitJournal *journal_create (const gchar *path)
+{
+  int fd = g_open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    {
+      g_warning ("Could not create journal %s: %s", path, g_strerror (errno));
+      return NULL;
+    }
+
+  GromitJournal *j = journal_new (path, fd);
+  if (!journal_map (j, JOURNAL_CHUNK))
+    {
+      g_warning ("Could not map journal %s", path);
+      journal_close (j);
+      return NULL;
+    }
+
+  memcpy (j->map, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+  j->used = JOURNAL_MAGIC_LEN;
+  j->pending = j->used;
+  return j;
+}
+
+
+void journal_close (GromitJournal *j)
+{
+  if (!j)
+    return;
+
+  if (j->map)
+    {
+      msync (j->map, j->used, MS_ASYNC);
+      munmap (j->map, j->mapped);
+    }
+  /* drop the zeroed reserve at the end */
+  if (ftruncate (j->fd, j->used) != 0)
+    g_warning ("Could not trim journal %s", j->path);
+  close (j->fd);
+  g_free (j->path);
+  g_free (j);
+}
+
+
+gboolean journal_rename (GromitJournal *j, const gchar *path)
+{
+  if (g_rename (j->path, path) != 0)
+    {
+      g_warning ("Could not move journal to %s: %s", path, g_strerror (errno));
+      return FALSE;
+    }
+  g_free (j->path);
+  j->path = g_strdup (path);
+  return TRUE;
+}
+
+
+gsize journal_size (const GromitJournal *j)
+{
+  return j->used;
+}
+
+
+gboolean journal_next (GromitJournal *j,
+		       gsize *offset,
+		       guint32 *type,
+		       const guchar **payload,
+		       guint32 *length)
+{
+  if (*offset < JOURNAL_MAGIC_LEN)
+    *offset = JOURNAL_MAGIC_LEN;
+
+  if (*offset + sizeof (RecordHeader) > j->mapped)
+    return FALSE;
+
+  const RecordHeader *header = (const RecordHeader *) (j->map + *offset);
+  guint32 record_type = g_atomic_int_get ((const gint *) &header->type);
+
+  if (record_type == 0 || *offset + record_size (header->length) > j->mapped)
+    return FALSE;
+
+  *type = record_type;
+  *length = header->length;
+  *payload = j->map + *offset + sizeof (RecordHeader);
+  *offset += record_size (header->length);
+  return TRUE;
+}
+
+
+guchar *journal_reserve (GromitJournal *j, guint32 length)
+{
+  gsize end = j->used + record_size (length);
+
+  /* keep room for the zero header that ends the journal */
+  if (end + sizeof (RecordHeader) > j->mapped)
+    {
+      gsize size = MAX (2 * j->mapped, end + sizeof (RecordHeader) + JOURNAL_CHUNK);
+      if (!journal_map (j, size))
+	{
+	  g_warning ("Could not grow journal %s", j->path);
+	  return NULL;
+	}
+    }
+
+  RecordHeader *header = (RecordHeader *) (j->map + j->used);
+  header->length = length;
+  header->type = 0;
+  j->pending = end;
+  return j->map + j->used + sizeof (RecordHeader);
+}
+
+
+void journal_commit (GromitJournal *j, guint32 type)
+{
+  RecordHeader *header = (RecordHeader *) (j->map + j->used);
+
+  /* the payload has to be in place before the record counts */
+  g_atomic_int_set ((gint *) &header->type, type);
+  j->used = j->pending;
+}
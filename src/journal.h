@@ -0,0 +1,45 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+  Append-only file of typed binary records, memory-mapped.
+  A record is an 8 byte header of length and type followed by the payload,
+  padded to 8 bytes. The type is stored last, so a record only becomes
+  visible once it is complete and a crash at any point leaves the earlier
+  records intact. Unused space at the end is zero, which reads as the end
+  of the journal.
+*/
+
+#include <glib.h>
+
+typedef struct _GromitJournal GromitJournal;
+
+
+/* maps an existing journal for reading and appending, NULL if there is none */
+GromitJournal *journal_open (const gchar *path);
+/* starts an empty journal, replacing any file at 'path' */
+GromitJournal *journal_create (const gchar *path);
+void journal_close (GromitJournal *j);
+
+/* atomically move the journal file to 'path' */
+gboolean journal_rename (GromitJournal *j, const gchar *path);
+
+/* bytes of the records appended so far */
+gsize journal_size (const GromitJournal *j);
+
+/*
+  Iterate over the records, starting with *offset = 0. Payload pointers stay
+  valid until the next append.
+*/
+gboolean journal_next (GromitJournal *j, gsize *offset,
+		       guint32 *type, const guchar **payload, guint32 *length);
+
+/*
+  Append a record: journal_reserve() returns where to write its 'length'
+  bytes of payload, journal_commit() then makes it visible. Returns NULL if
+  the file cannot grow.
+*/
+guchar *journal_reserve (GromitJournal *j, guint32 length);
+void journal_commit (GromitJournal *j, guint32 type);
+
+#endif
@@ -0,0 +1,78 @@
+
+#include <math.h>
+#include "latency.h"
+
+/* allowed difference between the clocks, X truncates to ms */
+#define CLOCK_SLACK_MS 50
+#define CLOCK_MISMATCH_MS 10000
+
+
+void latency_record (GromitLatency *l,
+		     GromitLatencyStage stage,
+		     guint32 event_time)
+{
+  GromitLatencyHistogram *h = &l->stage[stage];
+  guint32 now = g_get_monotonic_time () / 1000;
+  gint32 ms = (gint32) (now - event_time);
+
+  if (event_time == 0 || ms < -CLOCK_SLACK_MS || ms > CLOCK_MISMATCH_MS)
+    {
+      h->dropped++;
+      return;
+    }
+
+  h->count[CLAMP (ms, 0, LATENCY_BUCKETS - 1)]++;
+  h->total++;
+}
+
+
+guint latency_percentile (const GromitLatencyHistogram *h,
+			  gdouble percent)
+{
+  guint64 want = ceil (h->total * percent / 100);
+  guint64 seen = 0;
+
+  for (guint i = 0; i < LATENCY_BUCKETS - 1; i++)
+    {
+      seen += h->count[i];
+      if (seen >= want)
+	return i;
+    }
+  return G_MAXUINT;
+}
+
+
+static void print_percentile (GString *out,
+			      const GromitLatencyHistogram *h,
+			      gdouble percent)
+{
+  guint ms = latency_percentile (h, percent);
+
+  if (ms == G_MAXUINT)
+    g_string_append_printf (out, "  p%.0f >=%d ms", percent, LATENCY_BUCKETS - 1);
+  else
+    g_string_append_printf (out, "  p%.0f %3u ms", percent, ms);
+}
+
+
+void latency_print (GString *out,
+		    const GromitLatency *l)
+{
+  static const gchar *names[GROMIT_LATENCY_STAGES] = { "receive", "raster", "paint" };
+
+  for (int s = 0; s < GROMIT_LATENCY_STAGES; s++)
+    {
+      const GromitLatencyHistogram *h = &l->stage[s];
+
+      g_string_append_printf (out, "  %-8s %8" G_GUINT64_FORMAT " events", names[s], h->total);
+      if (h->total > 0)
+	{
+	  print_percentile (out, h, 50);
+	  print_percentile (out, h, 95);
+	  print_percentile (out, h, 99);
+	}
+      if (h->dropped > 0)
+	g_string_append_printf (out, "  (%" G_GUINT64_FORMAT " on another clock)", h->dropped);
+      g_string_append_c (out, '\n');
+    }
+}
@@ -0,0 +1,46 @@
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+/*
+  Latency from an input event to the stages of drawing it, measured
+  against the event's X server time. That is CLOCK_MONOTONIC in ms with a
+  local Xorg server, the same clock as g_get_monotonic_time(), so samples
+  that are not within a few seconds of now are assumed to come from
+  another clock and dropped.
+*/
+
+#include <glib.h>
+
+typedef enum
+{
+  GROMIT_LATENCY_RECEIVE,   /* on_motion() got the event */
+  GROMIT_LATENCY_RASTER,    /* draw_flush_segments() rasterized it */
+  GROMIT_LATENCY_PAINT,     /* on_expose() put it on the window */
+  GROMIT_LATENCY_STAGES
+} GromitLatencyStage;
+
+/* one bucket per ms, the last one collects everything slower */
+#define LATENCY_BUCKETS 256
+
+typedef struct
+{
+  guint32 count[LATENCY_BUCKETS];
+  guint64 total;
+  /* event times not on our clock */
+  guint64 dropped;
+} GromitLatencyHistogram;
+
+typedef struct
+{
+  GromitLatencyHistogram stage[GROMIT_LATENCY_STAGES];
+} GromitLatency;
+
+/* count the time from 'event_time' until now for 'stage' */
+void latency_record (GromitLatency *l, GromitLatencyStage stage, guint32 event_time);
+/* ms within which 'percent' of the samples were, G_MAXUINT if it is in the last bucket */
+guint latency_percentile (const GromitLatencyHistogram *h, gdouble percent);
+/* append a line per stage with count and p50/p95/p99 to 'out' */
+void latency_print (GString *out, const GromitLatency *l);
+
+#endif
@@ -23,12 +23,15 @@
 
 #include <string.h>
 #include <stdlib.h>
-#include <lz4.h>
 
 #include "callbacks.h"
 #include "config.h"
+#include "drawing.h"
 #include "input.h"
 #include "main.h"
+#include "render.h"
+#include "undo.h"
+#include "trace.h"
 #include "build-config.h"
 
 #include "paint_cursor.xpm"
@@ -48,6 +51,7 @@ GromitPaintContext *paint_context_new (GromitData *data,
                                        guint maxangle,
                                        guint minlen,
                                        guint snapdist,
+                                       guint predict,
 				       guint minwidth,
 				       guint maxwidth)
 {
@@ -67,8 +71,9 @@ GromitPaintContext *paint_context_new (GromitData *data,
   context->simplify = simpilfy;
   context->minlen = minlen;
   context->snapdist = snapdist;
+  context->predict = predict;
 
-  context->paint_ctx = cairo_create (data->backbuffer);
+  context->paint_ctx = cairo_create (data->backbuffer->proxy);
 
   gdk_cairo_set_source_rgba(context->paint_ctx, paint_color);
   if(!data->composited)
@@ -137,6 +142,8 @@ void paint_context_print (gchar *name,
       if (context->snapdist > 0)
         g_printerr(" snap: %u, ", context->snapdist);
     }
+  if (context->predict > 0)
+    g_printerr(" predict: %u, ", context->predict);
   if (context->type == GROMIT_ORTHOGONAL)
     {
       g_printerr(" radius: %u, minlen: %u, maxangle: %u ",
@@ -215,18 +222,21 @@ void toggle_visibility (GromitData *data)
 
 void clear_screen (GromitData *data)
 {
-  cairo_t *cr = cairo_create(data->backbuffer);
-  cairo_set_source_rgba(cr, 0, 0, 0, 0);
-  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-  cairo_paint (cr);
-  cairo_destroy(cr);
+  draw_flush_all(data);
+
+  /*
+    Not a step of its own: the cleared tiles go to the current step, so
+    undo brings back the screen as it was before the last stroke.
+  */
+  undo_log_clear(data);
+  tiled_surface_clear(data->backbuffer);
 
   GdkRectangle rect = {0, 0, data->width, data->height};
   gdk_window_invalidate_rect(gtk_widget_get_window(data->win), &rect, 0);
 
   if(!data->composited)
     {
-      cairo_region_t* r = gdk_cairo_region_create_from_surface(data->backbuffer);
+      cairo_region_t* r = tiled_surface_create_region(data->backbuffer);
       gtk_widget_shape_combine_region(data->win, r);
       cairo_region_destroy(r);
       // try to set transparent for input
@@ -254,7 +264,32 @@ gint reshape (gpointer user_data)
         }
       else
         {
-	  cairo_region_t* r = gdk_cairo_region_create_from_surface(data->backbuffer);
+	  guint n_dirty = data->backbuffer->n_dirty;
+	  gint64 start = g_get_monotonic_time();
+
+	  cairo_region_t* r = tiled_surface_create_region(data->backbuffer);
+
+	  /* shapes in progress are not in the backbuffer yet */
+	  GHashTableIter it;
+	  gpointer value;
+	  g_hash_table_iter_init (&it, data->devdatatable);
+	  while (g_hash_table_iter_next (&it, NULL, &value))
+	    {
+	      GromitDeviceData *devdata = value;
+	      if (devdata->preview)
+		cairo_region_union_rectangle(r, &devdata->preview_rect);
+	      if (devdata->stroke)
+		{
+		  cairo_region_t *stroke = tiled_surface_create_region(devdata->stroke);
+		  cairo_region_union(r, stroke);
+		  cairo_region_destroy(stroke);
+		}
+	    }
+
+	  if(data->debug)
+	    g_printerr("DEBUG: reshape rescanned %u tiles in %" G_GINT64_FORMAT " us\n",
+		       n_dirty, g_get_monotonic_time() - start);
+
 	  gtk_widget_shape_combine_region(data->win, r);
 	  cairo_region_destroy(r);
 	  // try to set transparent for input
@@ -276,332 +311,295 @@ gint reshape (gpointer user_data)
 }
 
 
-void select_tool (GromitData *data,
-		  GdkDevice *device,
-		  GdkDevice *slave_device,
-		  guint state)
+/* what select_tool() resolves, for one device, slave and set of buttons and modifiers */
+typedef struct
+{
+  GdkDevice *device;
+  GdkDevice *slave;
+  guint      buttons;
+  guint      modifier;
+} GromitToolKey;
+
+typedef struct
+{
+  GromitPaintContext *context;
+  GdkCursor          *cursor;
+} GromitToolChoice;
+
+
+static guint tool_key_hash (gconstpointer p)
+{
+  const GromitToolKey *key = p;
+  return g_direct_hash (key->device) ^ (g_direct_hash (key->slave) * 31)
+    ^ (key->buttons << 3 | key->modifier);
+}
+
+
+static gboolean tool_key_equal (gconstpointer a,
+				gconstpointer b)
+{
+  const GromitToolKey *ka = a, *kb = b;
+  return ka->device == kb->device && ka->slave == kb->slave &&
+    ka->buttons == kb->buttons && ka->modifier == kb->modifier;
+}
+
+
+/*
+ * Find the tool configured for 'slave_device' attached to 'device', or
+ * for 'device', or for the default device, with the buttons and
+ * modifiers 'req_buttons' and 'req_modifier' or a subset of them.
+ */
+static GromitPaintContext *resolve_tool (GromitData *data,
+					 GdkDevice *device,
+					 GdkDevice *slave_device,
+					 guint req_buttons,
+					 guint req_modifier)
 {
-  g_print("select_tool");
   guint buttons = 0, modifier = 0, slave_len = 0, len = 0, default_len = 0;
-  guint req_buttons = 0, req_modifier = 0;
   guint i, j, success = 0;
   GromitPaintContext *context = NULL;
+  GromitPaintContext *result = NULL;
   guchar *slave_name;
   guchar *name;
   guchar *default_name;
 
-  /* get the data for this device */
-  GromitDeviceData *devdata = g_hash_table_lookup(data->devdatatable, device);
-
-  if (device)
-    {
-      slave_len = strlen (gdk_device_get_name(slave_device));
-      slave_name = (guchar*) g_strndup (gdk_device_get_name(slave_device), slave_len + 3);
-      len = strlen (gdk_device_get_name(device));
-      name = (guchar*) g_strndup (gdk_device_get_name(device), len + 3);
-      default_len = strlen(DEFAULT_DEVICE_NAME);
-      default_name = (guchar*) g_strndup (DEFAULT_DEVICE_NAME, default_len + 3);
+  slave_len = strlen (gdk_device_get_name(slave_device));
+  slave_name = (guchar*) g_strndup (gdk_device_get_name(slave_device), slave_len + 3);
+  len = strlen (gdk_device_get_name(device));
+  name = (guchar*) g_strndup (gdk_device_get_name(device), len + 3);
+  default_len = strlen(DEFAULT_DEVICE_NAME);
+  default_name = (guchar*) g_strndup (DEFAULT_DEVICE_NAME, default_len + 3);
 
+  slave_name [slave_len] = 124;
+  slave_name [slave_len+3] = 0;
+  name [len] = 124;
+  name [len+3] = 0;
+  default_name [default_len] = 124;
+  default_name [default_len+3] = 0;
 
-      /* Extract Button/Modifiers from state (see GdkModifierType) */
-      req_buttons = (state >> 8) & 31;
-
-      req_modifier = (state >> 1) & 7;
-      if (state & GDK_SHIFT_MASK) req_modifier |= 1;
-
-      slave_name [slave_len] = 124;
-      slave_name [slave_len+3] = 0;
-      name [len] = 124;
-      name [len+3] = 0;
-      default_name [default_len] = 124;
-      default_name [default_len+3] = 0;
+  /*
+    Iterate i up until <= req_buttons.
+    For each i, find out if bits of i are _all_ in `req_buttons`.
+    - If yes, lookup if there is tool and select if there is.
+    - If no, try next i, no tool lookup.
+  */
+  context = NULL;
+  i=-1;
+  do
+    {
+      i++;
 
       /*
-	Iterate i up until <= req_buttons.
-	For each i, find out if bits of i are _all_ in `req_buttons`.
-	- If yes, lookup if there is tool and select if there is.
-	- If no, try next i, no tool lookup.
+	For all i > 0, find out if _all_ bits representing the iterator 'i'
+	are present in req_buttons as well. If not (none or only some are),
+	then go on.
+	The condition i==0 handles the config cases where no button is given.
       */
-      context = NULL;
-      i=-1;
+      buttons = i & req_buttons;
+      if(i > 0 && (buttons == 0 || buttons != i))
+          continue;
+
+      j=-1;
       do
         {
-          i++;
-
-	  /*
-	    For all i > 0, find out if _all_ bits representing the iterator 'i'
-	    are present in req_buttons as well. If not (none or only some are),
-	    then go on.
-	    The condition i==0 handles the config cases where no button is given.
-	  */
-          buttons = i & req_buttons;
-          if(i > 0 && (buttons == 0 || buttons != i))
-              continue;
-
-          j=-1;
-          do
+          j++;
+          modifier = req_modifier & ((1 << j)-1);
+          slave_name [slave_len+1] = buttons + 64;
+          slave_name [slave_len+2] = modifier + 48;
+          name [len+1] = buttons + 64;
+          name [len+2] = modifier + 48;
+          default_name [default_len+1] = buttons + 64;
+          default_name [default_len+2] = modifier + 48;
+
+          if(data->debug)
+            g_printerr("DEBUG: select_tool looking up context for '%s' attached to '%s'\n", slave_name, name);
+
+          context = g_hash_table_lookup (data->tool_config, slave_name);
+          if (data->use_graphical_menu_items)
+          {
+            int current_tool = data->current_graph_menu_tool;
+            TRACE2(GROMIT_TRACE_DEBUG, "menu tool, type", current_tool, data->current_graph_menu_type[current_tool]);
+            context = data->graph_menu_tools[current_tool][data->current_graph_menu_type[current_tool]];
+            TRACE(GROMIT_TRACE_DEBUG, "after context=");
+          }
+          if(context) {
+              if(data->debug)
+                g_printerr("DEBUG: select_tool set context for '%s'\n", slave_name);
+              TRACE(GROMIT_TRACE_DEBUG, "setting result");
+              result = context;
+              TRACE(GROMIT_TRACE_DEBUG, "finished setting result");
+              success = 1;
+          }
+          else /* try master name */
+          if ((context = g_hash_table_lookup (data->tool_config, name)))
             {
-              j++;
-              modifier = req_modifier & ((1 << j)-1);
-              slave_name [slave_len+1] = buttons + 64;
-              slave_name [slave_len+2] = modifier + 48;
-              name [len+1] = buttons + 64;
-              name [len+2] = modifier + 48;
-              default_name [default_len+1] = buttons + 64;
-              default_name [default_len+2] = modifier + 48;
-
-	            if(data->debug)
-                g_printerr("DEBUG: select_tool looking up context for '%s' attached to '%s'\n", slave_name, name);
-
-              context = g_hash_table_lookup (data->tool_config, slave_name);
               if (data->use_graphical_menu_items)
               {
-                g_print("current_tool: %d\n",data->current_graph_menu_tool);
-                int current_tool = data->current_graph_menu_tool;
-                g_print("current_type: %d",data->current_graph_menu_type[current_tool]);
-                context = data->graph_menu_tools[current_tool][data->current_graph_menu_type[current_tool]];
-                g_print("after context=\n");
+                  int current_tool = data->current_graph_menu_tool;
+                  TRACE2(GROMIT_TRACE_DEBUG, "master: menu tool, type", current_tool, data->current_graph_menu_type[current_tool]);
+                  context = data->graph_menu_tools[current_tool][data->current_graph_menu_type[current_tool]];
               }
-              if(context) {
-                  if(data->debug)
-                    g_printerr("DEBUG: select_tool set context for '%s'\n", slave_name);
-                  g_print("setting devdata->cur_context\n");
-                  devdata->cur_context = context;
-                  g_print("finished setting devdata->cur_context\n");
-                  success = 1;
-              }
-              else /* try master name */
-              if ((context = g_hash_table_lookup (data->tool_config, name)))
+              if(data->debug)
+                g_printerr("DEBUG: select_tool set context for '%s'\n", name);
+              result = context;
+              success = 1;
+            }
+          else /* try default_name */
+            if((context = g_hash_table_lookup (data->tool_config, default_name)))
+              {
+                if (data->use_graphical_menu_items)
                 {
-                  if (data->use_graphical_menu_items)
-                  {
-                     g_print("#Mcurrent_tool: %d\n",data->current_graph_menu_tool);
-                      int current_tool = data->current_graph_menu_tool;
-                      g_print("#Mcurrent_type: %d",data->current_graph_menu_type[current_tool]);
-                      context = data->graph_menu_tools[current_tool][data->current_graph_menu_type[current_tool]];
-                  }
-                  if(data->debug)
-                    g_printerr("DEBUG: select_tool set context for '%s'\n", name);
-                  devdata->cur_context = context;
-                  success = 1;
+                  int current_tool = data->current_graph_menu_tool;
+                  TRACE2(GROMIT_TRACE_DEBUG, "default: menu tool, type", current_tool, data->current_graph_menu_type[current_tool]);
+                  context = data->graph_menu_tools[current_tool][data->current_graph_menu_type[current_tool]];
                 }
-              else /* try default_name */
-                if((context = g_hash_table_lookup (data->tool_config, default_name)))
-                  {
-                    if (data->use_graphical_menu_items)
-                    {
-                      g_print("#Dcurrent_tool: %d\n",data->current_graph_menu_tool);
-                      int current_tool = data->current_graph_menu_tool;
-                      g_print("#Dcurrent_type: %d",data->current_graph_menu_type[current_tool]);
-                      context = data->graph_menu_tools[current_tool][data->current_graph_menu_type[current_tool]];
-                    }
-                    if(data->debug)
-                      g_printerr("DEBUG: select_tool set default context '%s' for '%s'\n", default_name, name);
-                    devdata->cur_context = context;
-                    success = 1;
-                  }
-
-            }
-          while (j<=3 && req_modifier >= (1u << j));
-          g_print("finished while(j<=3)\n");
-        }
-      while (i < req_buttons);
-      g_print("finished while(i<req_buttons)\n");
-
-      if (!success)
-        {
-          g_print("not success\n");
-          if (gdk_device_get_source(device) == GDK_SOURCE_ERASER)
-            devdata->cur_context = data->default_eraser;
-          else
-            devdata->cur_context = data->default_pen;
+                if(data->debug)
+                  g_printerr("DEBUG: select_tool set default context '%s' for '%s'\n", default_name, name);
+                result = context;
+                success = 1;
+              }
 
-	  if(data->debug)
-	      g_printerr("DEBUG: select_tool set fallback context for '%s'\n", name);
         }
-
-      g_free (name);
-      g_free (default_name);
+      while (j<=3 && req_modifier >= (1u << j));
+      TRACE(GROMIT_TRACE_DEBUG, "finished while(j<=3)");
     }
-  else
-    g_printerr ("ERROR: select_tool attempted to select nonexistent device!\n");
-  g_print("mostly done, about to do cursor\n");
-  GdkCursor *cursor;
-  if(devdata->cur_context && devdata->cur_context->type == GROMIT_ERASER)
-    cursor = data->erase_cursor;
-  else
-    cursor = data->paint_cursor;
-
+  while (i < req_buttons);
+  TRACE(GROMIT_TRACE_DEBUG, "finished while(i<req_buttons)");
 
-  if(data->debug)
-    g_printerr("DEBUG: select_tool setting cursor %p\n",cursor);
+  if (!success)
+    {
+      TRACE(GROMIT_TRACE_DEBUG, "not success");
+      if (gdk_device_get_source(device) == GDK_SOURCE_ERASER)
+        result = data->default_eraser;
+      else
+        result = data->default_pen;
 
+      if(data->debug)
+	  g_printerr("DEBUG: select_tool set fallback context for '%s'\n", name);
+    }
 
-  //FIXME!  Should be:
-  //gdk_window_set_cursor(gtk_widget_get_window(data->win), cursor);
-  // doesn't work during a grab?
-  g_print("about to device_grab\n");
-  gdk_device_grab(device,
-  		  gtk_widget_get_window(data->win),
-  		  GDK_OWNERSHIP_NONE,
-  		  FALSE,
-  		  GROMIT_MOUSE_EVENTS,
-  		  cursor,
-  		  GDK_CURRENT_TIME);
+  g_free (slave_name);
+  g_free (name);
+  g_free (default_name);
 
-  devdata->state = state;
-  devdata->lastslave = slave_device;
-  g_print("finished selecting tool\n");
+  return result;
 }
 
 
-
-void snap_undo_state (GromitData *data)
+/*
+ * Forget the tools select_tool() resolved, for when the tool configuration
+ * or the devices change, and make the next event of every device select
+ * its tool again.
+ */
+void tool_cache_clear (GromitData *data)
 {
-  if(data->debug)
-    g_printerr ("DEBUG: Snapping undo buffer %d.\n", data->undo_head);
-
-  undo_compress(data, data->backbuffer);
-  undo_temp_buffer_to_slot(data, data->undo_head);
-
-  // Increment head position
-  data->undo_head++;
-  if(data->undo_head >= GROMIT_MAX_UNDO)
-    data->undo_head -= GROMIT_MAX_UNDO;
-  data->undo_depth++;
-  // See if we ran out of undo levels with oldest undo overwritten
-  if(data->undo_depth > GROMIT_MAX_UNDO)
-    data->undo_depth = GROMIT_MAX_UNDO;
-  // Invalidate any redo from this position
-  data->redo_depth = 0;
-}
-
+  if (data->tool_cache)
+    g_hash_table_remove_all (data->tool_cache);
 
+  if (!data->devdatatable)
+    return;
 
-void copy_surface (cairo_surface_t *dst, cairo_surface_t *src)
-{
-  cairo_t *cr = cairo_create(dst);
-  cairo_set_source_surface(cr, src, 0, 0);
-  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-  cairo_paint (cr);
-  cairo_destroy(cr);
+  GHashTableIter it;
+  gpointer value;
+  g_hash_table_iter_init (&it, data->devdatatable);
+  while (g_hash_table_iter_next (&it, NULL, &value))
+    ((GromitDeviceData *) value)->lastslave = NULL;
 }
 
 
-void undo_drawing (GromitData *data)
+void select_tool (GromitData *data,
+		  GdkDevice *device,
+		  GdkDevice *slave_device,
+		  guint state)
 {
-  if(data->undo_depth <= 0)
-    return;
-  data->undo_depth--;
-  data->redo_depth++;
-  if(data->redo_depth > GROMIT_MAX_UNDO)
-    data->redo_depth -= GROMIT_MAX_UNDO;
-  data->undo_head--;
-  if(data->undo_head < 0)
-    data->undo_head += GROMIT_MAX_UNDO;
-
-  undo_compress(data, data->backbuffer);
-  undo_decompress(data, data->undo_head, data->backbuffer);
-  undo_temp_buffer_to_slot(data, data->undo_head);
-
-  GdkRectangle rect = {0, 0, data->width, data->height};
-  gdk_window_invalidate_rect(gtk_widget_get_window(data->win), &rect, 0);
-
-  data->modified = 1;
-
-  if(data->debug)
-    g_printerr ("DEBUG: Undo drawing %d.\n", data->undo_head);
-}
+  TRACE(GROMIT_TRACE_DEBUG, "select_tool");
+  GdkCursor *cursor = data->paint_cursor;
 
+  /* get the data for this device */
+  GromitDeviceData *devdata = devices_lookup(data, device);
 
+  if (device)
+    {
+      GromitToolKey key;
+      key.device = device;
+      key.slave = slave_device;
 
-void redo_drawing (GromitData *data)
-{
-  if(data->redo_depth <= 0)
-    return;
+      /* Extract Button/Modifiers from state (see GdkModifierType) */
+      key.buttons = (state >> 8) & 31;
+
+      key.modifier = (state >> 1) & 7;
+      if (state & GDK_SHIFT_MASK) key.modifier |= 1;
+
+      if (!data->tool_cache)
+	data->tool_cache = g_hash_table_new_full (tool_key_hash, tool_key_equal, g_free, g_free);
+
+      GromitToolChoice *choice = g_hash_table_lookup (data->tool_cache, &key);
+      if (!choice)
+	{
+	  choice = g_new (GromitToolChoice, 1);
+	  choice->context = resolve_tool (data, device, slave_device, key.buttons, key.modifier);
+	  if (choice->context && choice->context->type == GROMIT_ERASER)
+	    choice->cursor = data->erase_cursor;
+	  else
+	    choice->cursor = data->paint_cursor;
+	  g_hash_table_insert (data->tool_cache, g_memdup (&key, sizeof (key)), choice);
+	}
+      else if (data->debug)
+	g_printerr("DEBUG: select_tool reusing context for '%s' attached to '%s'\n",
+		   gdk_device_get_name(slave_device), gdk_device_get_name(device));
+
+      devdata->cur_context = choice->context;
+      cursor = choice->cursor;
+    }
+  else
+    g_printerr ("ERROR: select_tool attempted to select nonexistent device!\n");
 
-  undo_compress(data, data->backbuffer);
-  undo_decompress(data, data->undo_head, data->backbuffer);
-  undo_temp_buffer_to_slot(data, data->undo_head);
+  /* grabbing again is the only way to change the cursor, and only needed for that */
+  if (cursor != devdata->grab_cursor)
+    {
+      if(data->debug)
+	g_printerr("DEBUG: select_tool setting cursor %p\n",cursor);
+
+      //FIXME!  Should be:
+      //gdk_window_set_cursor(gtk_widget_get_window(data->win), cursor);
+      // doesn't work during a grab?
+      TRACE(GROMIT_TRACE_DEBUG, "about to device_grab");
+      gdk_device_grab(device,
+		      gtk_widget_get_window(data->win),
+		      GDK_OWNERSHIP_NONE,
+		      FALSE,
+		      GROMIT_MOUSE_EVENTS,
+		      cursor,
+		      GDK_CURRENT_TIME);
+      devdata->grab_cursor = cursor;
+    }
 
-  data->redo_depth--;
-  data->undo_depth++;
-  data->undo_head++;
-  if(data->undo_head >= GROMIT_MAX_UNDO)
-    data->undo_head -= GROMIT_MAX_UNDO;
+  devdata->state = state;
+  devdata->lastslave = slave_device;
+  TRACE(GROMIT_TRACE_DEBUG, "finished selecting tool");
+}
 
-  GdkRectangle rect = {0, 0, data->width, data->height};
-  gdk_window_invalidate_rect(gtk_widget_get_window(data->win), &rect, 0);
 
-  data->modified = 1;
-  
-  if(data->debug)
-    g_printerr("DEBUG: Redo drawing.\n");
-}
 
 /*
- * compress image data and store it in undo_temp_buffer
- *
- * the undo_temp_buffer is successively grown in case it is too small
+ * write hook of the backbuffer, see tiled_surface_set_write_hook()
  */
-void undo_compress(GromitData *data, cairo_surface_t *surface)
+static void on_backbuffer_write (GromitTiledSurface *ts,
+				 guint index,
+				 gboolean first,
+				 gpointer user_data)
 {
-  char *raw_data = (char *)cairo_image_surface_get_data(surface);
-  guint bytes_per_row = cairo_image_surface_get_stride(surface);
-  guint rows = cairo_image_surface_get_height(surface);
-  size_t src_bytes = rows * bytes_per_row;
+  GromitData *data = (GromitData *) user_data;
 
-  size_t dest_bytes;
-  for (;;)
-    {
-      dest_bytes = LZ4_compress_default(raw_data, data->undo_temp, src_bytes, data->undo_temp_size);
-      if (dest_bytes == 0)
-        {
-          data->undo_temp_size *= 2;
-          data->undo_temp = g_realloc(data->undo_temp, data->undo_temp_size);
-        }
-      else
-        {
-          data->undo_temp_used = dest_bytes;
-          break;
-        }
-    }
+  undo_record_tile(data, ts, index);
 }
 
 
-/*
- * copy undo_temp to undo slot, growing undo buffer if required
- */
-void undo_temp_buffer_to_slot(GromitData *data, gint undo_slot)
+void copy_surface (GromitTiledSurface *dst, GromitTiledSurface *src)
 {
-    const size_t required = data->undo_temp_used;
-    if (data->undo_buffer_size[undo_slot] < required)
-      {
-        data->undo_buffer[undo_slot] = g_realloc(data->undo_buffer[undo_slot], required);
-        data->undo_buffer_size[undo_slot] = required;
-      }
-    data->undo_buffer_used[undo_slot] = required;
-    memcpy(data->undo_buffer[undo_slot], data->undo_temp, required);
+  tiled_surface_copy(dst, src);
 }
 
-/*
- * decompress undo slot data and store it in cairo surface
- */
-void undo_decompress(GromitData *data, gint undo_slot, cairo_surface_t *surface)
-{
-  char *dest_data = (char *)cairo_image_surface_get_data(surface);
-  guint bytes_per_row = cairo_image_surface_get_stride(surface);
-  guint rows = cairo_image_surface_get_height(surface);
-  size_t dest_bytes = rows * bytes_per_row;
-
-  char *src_data = data->undo_buffer[undo_slot];
-  size_t src_bytes = data->undo_buffer_used[undo_slot];
-
-  if (LZ4_decompress_safe(src_data, dest_data, src_bytes, dest_bytes) < 0) {
-    g_printerr("Fatal error occurred decompressing image data\n");
-    exit(1);
-  }
-}
 
 /*
  * Functions for handling various (GTK+)-Events
@@ -704,27 +702,19 @@ void setup_main_app (GromitData *data, int argc, char ** argv)
     DRAWING AREA
   */
   /* SHAPE SURFACE*/
-  cairo_surface_destroy(data->backbuffer);
-  data->backbuffer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, data->width, data->height);
+  tiled_surface_free(data->backbuffer);
+  data->backbuffer = tiled_surface_new(data->width, data->height);
+  tiled_surface_set_write_hook(data->backbuffer, on_backbuffer_write, data);
 
-  // original state for LINE and RECT tool
-  cairo_surface_destroy(data->aux_backbuffer);
-  data->aux_backbuffer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, data->width, data->height);
+  /*
+    DAMAGE ACCUMULATOR
+  */
+  data->damage = cairo_region_create();
 
   /*
     UNDO STATE
   */
-  data->undo_head = 0;
-  data->undo_depth = 0;
-  data->redo_depth = 0;
-  data->undo_temp_size = 0x10000;
-  data->undo_temp = g_malloc(data->undo_temp_size);
-  data->undo_temp_used = 0;
-  for (int i = 0; i < GROMIT_MAX_UNDO; i++)
-    {
-      data->undo_buffer_size[i] = 0;
-      data->undo_buffer[i] = NULL;
-    }
+  undo_init(data);
 
   /* EVENTS */
   gtk_widget_add_events (data->win, GROMIT_WINDOW_EVENTS);
@@ -764,7 +754,7 @@ void setup_main_app (GromitData *data, int argc, char ** argv)
 
   if(!data->composited) // set initial shape
     {
-      cairo_region_t* r = gdk_cairo_region_create_from_surface(data->backbuffer);
+      cairo_region_t* r = tiled_surface_create_region(data->backbuffer);
       gtk_widget_shape_combine_region(data->win, r);
       cairo_region_destroy(r);
     }
@@ -787,6 +777,7 @@ void setup_main_app (GromitData *data, int argc, char ** argv)
   gtk_selection_add_target (data->win, GA_CONTROL, GA_LINE, 10);
   gtk_selection_add_target (data->win, GA_CONTROL, GA_GUIMENU,11);
   gtk_selection_add_target (data->win, GA_CONTROL, GA_OPENTOGGLE,12);
+  gtk_selection_add_target (data->win, GA_CONTROL, GA_STATS, 13);
 
 
 
@@ -811,6 +802,17 @@ void setup_main_app (GromitData *data, int argc, char ** argv)
   // might have been in key file
   gtk_widget_set_opacity(data->win, data->opacity);
 
+  /*
+    TRACING, dumped on SIGUSR1
+  */
+  trace_init(data->debug);
+
+  /*
+    RESTORE DRAWING OF LAST RUN
+  */
+  if (data->undo_journal_enabled)
+    undo_journal_restore(data);
+
   /*
      FIND HOTKEY KEYCODE
   */
@@ -900,6 +902,8 @@ void setup_main_app (GromitData *data, int argc, char ** argv)
   */
   data->devdatatable = g_hash_table_new(NULL, NULL);
   setup_input_devices (data);
+  if (data->xi2_motion)
+    setup_xi2_motion (data);
 
 
 
@@ -914,10 +918,10 @@ void setup_main_app (GromitData *data, int argc, char ** argv)
 
   data->default_pen =
     paint_context_new (data, GROMIT_PEN, data->red, 7, 0, GROMIT_ARROW_END,
-                       5, 10, 15, 25, 0, 1, G_MAXUINT);
+                       5, 10, 15, 25, 0, 0, 1, G_MAXUINT);
   data->default_eraser =
     paint_context_new (data, GROMIT_ERASER, data->red, 75, 0, GROMIT_ARROW_END,
-                       5, 10, 15, 25, 0, 1, G_MAXUINT);
+                       5, 10, 15, 25, 0, 0, 1, G_MAXUINT);
 
   gdk_event_handler_set ((GdkEventFunc) main_do_event, data, NULL);
   gtk_key_snooper_install (snoop_key_press, data);
@@ -1237,6 +1241,10 @@ int main_client (int argc, char **argv, GromitData *data)
        {
          action = GA_OPENTOGGLE;
        }
+       else if (strcmp (arg, "--stats") == 0)
+         {
+           action = GA_STATS;
+         }
        else
          {
            g_printerr ("Unknown Option to control a running Gromit-MPX process: \"%s\"\n", arg);
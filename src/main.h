@@ -35,6 +35,10 @@
 #include <libayatana-appindicator/app-indicator.h>
 #endif
 
+#include "tiles.h"
+#include "predict.h"
+#include "latency.h"
+
 #define GROMIT_MOUSE_EVENTS ( GDK_BUTTON_MOTION_MASK | \
                               GDK_BUTTON_PRESS_MASK | \
                               GDK_BUTTON_RELEASE_MASK )
@@ -56,12 +60,14 @@
 #define GA_REDO       gdk_atom_intern ("Gromit/redo", FALSE)
 #define GA_GUIMENU    gdk_atom_intern ("Gromit/menutoggle", FALSE)
 #define GA_OPENTOGGLE gdk_atom_intern ("Gromit/opentoggle", FALSE)
+#define GA_STATS      gdk_atom_intern ("Gromit/stats", FALSE)
 
 #define GA_DATA       gdk_atom_intern ("Gromit/data", FALSE)
 #define GA_TOGGLEDATA gdk_atom_intern ("Gromit/toggledata", FALSE)
 #define GA_LINEDATA   gdk_atom_intern ("Gromit/linedata", FALSE)
 
-#define GROMIT_MAX_UNDO 100
+#define GROMIT_DEFAULT_UNDO_MEMORY_MB 256
+#define GROMIT_DEFAULT_UNDO_KEYFRAME_INTERVAL 20
 // GROMIT_NUMBER_OF_GUI_TOOLS can be edited to have how many tools you want.
 // IF you change this, make sure you delete your .gromit_config or change its name
 #define GROMIT_NUMBER_OF_GUI_TOOLS 6
@@ -105,6 +111,11 @@ typedef enum
   GROMIT_ARROW_START = 2,
   GROMIT_ARROW_DOUBLE =3
 } GromitArrowType;
+typedef enum
+{
+  GROMIT_UNDO_TILES,
+  GROMIT_UNDO_COMMANDS
+} GromitUndoEngine;
 typedef struct {
     gint x;
     gint y;
@@ -123,11 +134,24 @@ typedef struct
   guint           maxangle;
   guint           simplify;
   guint           snapdist;
+  /* ms to extrapolate the stroke ahead on the preview layer, 0 for none */
+  guint           predict;
   GdkRGBA         *paint_color;
   cairo_t         *paint_ctx;
   gdouble         pressure;
 } GromitPaintContext;
 
+typedef struct
+{
+  gdouble      x;
+  gdouble      y;
+  gdouble      pressure;
+  /* from the motion history, as opposed to the event position */
+  gboolean     history;
+  /* server time in ms */
+  guint32      time;
+} GromitMotionSample;
+
 typedef struct
 {
   gdouble      lastx;
@@ -140,7 +164,51 @@ typedef struct
   GromitPaintContext *cur_context;
   gboolean     is_grabbed;
   gboolean     was_grabbed;
+  /* cursor of the grab we have, NULL if there is none */
+  GdkCursor*   grab_cursor;
   GdkDevice*   lastslave;
+  /* XI2 device id, -1 when not on X11 */
+  gint         xi2_id;
+  /* pressure valuator of the slave last seen by the XI2 backend, see
+     setup_xi2_motion() */
+  gint         xi2_source;
+  gint         xi2_pressure;
+  gdouble      xi2_pressure_min;
+  gdouble      xi2_pressure_max;
+  gdouble      xi2_last_pressure;
+  /* motion samples not yet rasterized, see process_motion() */
+  GArray*      motion;
+  /* in-progress LINE or RECT shape, see draw_preview() */
+  cairo_surface_t *preview;
+  GdkRectangle preview_rect;
+  gint         preview_x;
+  gint         preview_y;
+  guint        preview_width;
+  /* recent samples of the stroke, see draw_prediction() */
+  GromitPredictor predictor;
+  /* line segments not yet rasterized, see draw_flush_segments() */
+  GArray*      segments;
+  GromitPaintContext *segments_context;
+  /* translucent pen stroke in progress, filled in the opaque color and
+     painted to the backbuffer with 'stroke_alpha' by draw_stroke_end() */
+  GromitTiledSurface *stroke;
+  GromitPaintContext *stroke_context;
+  gdouble      stroke_alpha;
+  /* event to screen latency, see latency.h; event time of the sample
+     draw_line() is drawing, of the oldest one not yet rasterized and of
+     the oldest one not yet on screen */
+  GromitLatency latency;
+  guint32      draw_time;
+  guint32      raster_time;
+  guint32      paint_time;
+  /* area drawn since paint_time, NULL if none */
+  cairo_region_t *paint_damage;
+  /* SMOOTH and ORTHOGONAL: the tiles the stroke draws to as they were
+     before, and which ones those are, see draw_capture_begin() */
+  GromitTiledSurface *aux;
+  guint8      *aux_captured;
+  /* own undo step with UndoPerDevice, see undo_set_writer() */
+  struct _GromitUndoEntry *undo_recording;
 } GromitDeviceData;
 
 
@@ -180,12 +248,31 @@ typedef struct
   GromitPaintContext *default_eraser;
  
   GHashTable  *tool_config;
+  /* tools select_tool() resolved by device, slave and state, see tool_cache_clear() */
+  GHashTable  *tool_cache;
 
-  cairo_surface_t *backbuffer;
-  /* Auxiliary backbuffer for tools like LINE or RECT */
-  cairo_surface_t *aux_backbuffer;
+  GromitTiledSurface *backbuffer;
 
   GHashTable  *devdatatable;
+  /* the same device data indexed by XI2 device id, see devices_lookup() */
+  GPtrArray   *devices_by_id;
+  /* take motion straight from XI2 events instead of GDK, see setup_xi2_motion() */
+  gboolean     xi2_motion;
+  gint         xi2_opcode;
+
+  /* pending frame clock tick, see render.c */
+  guint        frame_tick_id;
+  /* debug counters of queued motion */
+  guint64      motion_samples;
+  guint64      motion_batches;
+  /* screen damage accumulated since the last frame */
+  cairo_region_t *damage;
+  guint64      damage_rects;
+  guint64      damage_flushed_rects;
+  guint64      damage_flushes;
+  /* debug counters of on_expose() */
+  guint64      expose_count;
+  guint64      expose_bytes;
 
   guint        timeout_id;
   guint        modified;
@@ -200,14 +287,42 @@ typedef struct
 
   gchar       *clientdata;
 
-  /* undo buffer */
-  gchar  *undo_buffer[GROMIT_MAX_UNDO];
-  size_t undo_buffer_size[GROMIT_MAX_UNDO];
-  size_t undo_buffer_used[GROMIT_MAX_UNDO];
-  gchar *undo_temp;
-  size_t undo_temp_size;
-  size_t undo_temp_used;
-  gint   undo_head, undo_depth, redo_depth;
+  /* undo buffer, see undo.c */
+  GQueue undo_steps;   /* oldest first */
+  GQueue redo_steps;   /* next redo first */
+  struct _GromitUndoEntry *undo_recording;
+  /* separate undo for each device, GROMIT_UNDO_TILES only */
+  gboolean undo_per_device;
+  GromitDeviceData *undo_writer;
+  guint32 undo_next_tag;
+  const struct _GromitCodec *undo_codec;
+  gsize  undo_bytes;
+  gsize  undo_budget;
+  GromitUndoEngine undo_engine;
+  guint  undo_keyframe_interval;
+  GQueue undo_hot;     /* entries with raw tiles, last swapped first */
+  /* last blob of each backbuffer tile and the tile version it is of */
+  struct _GromitUndoBlob **undo_cache;
+  guint64 *undo_cache_version;
+  guint  undo_cache_size;
+  /* crash-safe copy, see undo_journal_restore(). The journal itself is
+     only used by the worker. */
+  gboolean undo_journal_enabled;
+  struct _GromitJournal *undo_journal;
+  gchar   *undo_journal_path;
+  guint32  undo_journal_gen;
+  guint32  undo_journal_next_id;
+  guint    undo_journal_timeout;
+  /* compression worker, see undo_wait(), and journal writer */
+  GThread     *undo_thread;
+  GAsyncQueue *undo_queue;
+  GThread     *undo_journal_thread;
+  GAsyncQueue *undo_journal_queue;
+  GMutex       undo_lock;
+  GCond        undo_cond;
+  /* compressions handed to the worker and finished by it */
+  guint64      undo_queued;
+  guint64      undo_done;
   gboolean started_from_gui;
 
   gboolean show_intro_on_startup;
@@ -233,14 +348,9 @@ void show_window (GromitData *data);
 void parse_print_help (gpointer key, gpointer value, gpointer user_data);
 
 void select_tool (GromitData *data, GdkDevice *device, GdkDevice *slave_device, guint state);
+void tool_cache_clear (GromitData *data);
 
-void copy_surface (cairo_surface_t *dst, cairo_surface_t *src);
-void snap_undo_state(GromitData *data);
-void undo_drawing (GromitData *data);
-void redo_drawing (GromitData *data);
-void undo_compress(GromitData *data, cairo_surface_t *surface);
-void undo_temp_buffer_to_slot(GromitData *data, gint undo_slot);
-void undo_decompress(GromitData *data, gint undo_slot, cairo_surface_t *surface);
+void copy_surface (GromitTiledSurface *dst, GromitTiledSurface *src);
 
 void clear_screen (GromitData *data);
 
@@ -248,6 +358,7 @@ GromitPaintContext *paint_context_new (GromitData *data, GromitPaintType type,
 				       GdkRGBA *fg_color, guint width,
                                        guint arrowsize, GromitArrowType arrowtype,
                                        guint simpilfy, guint radius, guint maxangle, guint minlen, guint snapdist,
+                                       guint predict,
                                        guint minwidth, guint maxwidth);
 void paint_context_free (GromitPaintContext *context);
 
@@ -0,0 +1,128 @@
+
+#include <math.h>
+#include "predict.h"
+
+/* share of the fitted acceleration that is followed, it overshoots turns otherwise */
+#define ACCEL_DAMPING 0.5
+/* the prediction may go at most this much further than the current speed gets */
+#define MAX_SPEEDUP 1.5
+
+
+void predictor_reset (GromitPredictor *p)
+{
+  p->head = 0;
+  p->n = 0;
+}
+
+
+void predictor_add (GromitPredictor *p,
+		    gdouble x, gdouble y,
+		    guint32 time)
+{
+  if (p->n > 0)
+    {
+      guint32 newest = p->time[p->head];
+      if (time < newest)
+	return;
+      /* the motion history repeats the event position, keep the last one */
+      if (time == newest)
+	{
+	  p->x[p->head] = x;
+	  p->y[p->head] = y;
+	  return;
+	}
+      p->head = (p->head + 1) % PREDICT_POINTS;
+    }
+
+  p->x[p->head] = x;
+  p->y[p->head] = y;
+  p->time[p->head] = time;
+  if (p->n < PREDICT_POINTS)
+    p->n++;
+}
+
+
+/*
+ * Least squares fit of v(t) = a + b t + c t^2 given the sums of t^k and
+ * of v t^k. Falls back to a straight line, c = 0, if the samples do not
+ * determine a parabola.
+ */
+static void fit (const gdouble st[5],
+		 const gdouble sv[3],
+		 gdouble *b, gdouble *c)
+{
+  gdouble det = st[0] * (st[2] * st[4] - st[3] * st[3])
+	      - st[1] * (st[1] * st[4] - st[3] * st[2])
+	      + st[2] * (st[1] * st[3] - st[2] * st[2]);
+
+  if (st[0] >= 3 && fabs (det) > 1e-6 * st[0] * st[2] * st[4])
+    {
+      *b = (st[0] * (sv[1] * st[4] - st[3] * sv[2])
+	    - sv[0] * (st[1] * st[4] - st[3] * st[2])
+	    + st[2] * (st[1] * sv[2] - sv[1] * st[2])) / det;
+      *c = (st[0] * (st[2] * sv[2] - sv[1] * st[3])
+	    - st[1] * (st[1] * sv[2] - sv[1] * st[2])
+	    + sv[0] * (st[1] * st[3] - st[2] * st[2])) / det;
+    }
+  else
+    {
+      *b = (st[0] * sv[1] - st[1] * sv[0]) / (st[0] * st[2] - st[1] * st[1]);
+      *c = 0;
+    }
+}
+
+
+gboolean predictor_predict (const GromitPredictor *p,
+			    guint horizon,
+			    gdouble *x, gdouble *y)
+{
+  gdouble st[5] = { 0 }, sx[3] = { 0 }, sy[3] = { 0 };
+  guint32 newest = p->time[p->head];
+  guint i;
+
+  if (p->n < 2)
+    return FALSE;
+
+  /* times relative to the newest sample keep the sums well conditioned */
+  for (i = 0; i < p->n; i++)
+    {
+      guint k = (p->head + PREDICT_POINTS - i) % PREDICT_POINTS;
+      if (newest - p->time[k] > PREDICT_WINDOW_MS)
+	break;
+      gdouble t = (gdouble) p->time[k] - (gdouble) newest;
+      gdouble tk = 1;
+      for (int e = 0; e < 5; e++, tk *= t)
+	{
+	  st[e] += tk;
+	  if (e < 3)
+	    {
+	      sx[e] += p->x[k] * tk;
+	      sy[e] += p->y[k] * tk;
+	    }
+	}
+    }
+
+  /* two samples at least, and not all at the same time */
+  if (st[0] < 2 || st[0] * st[2] - st[1] * st[1] <= 0)
+    return FALSE;
+
+  gdouble bx, cx, by, cy;
+  fit (st, sx, &bx, &cx);
+  fit (st, sy, &by, &cy);
+
+  gdouble h = horizon;
+  gdouble dx = bx * h + ACCEL_DAMPING * cx * h * h;
+  gdouble dy = by * h + ACCEL_DAMPING * cy * h * h;
+
+  gdouble dist = hypot (dx, dy);
+  gdouble limit = MAX_SPEEDUP * hypot (bx, by) * h;
+  if (dist > limit)
+    {
+      dx *= limit / dist;
+      dy *= limit / dist;
+    }
+
+  *x = p->x[p->head] + dx;
+  *y = p->y[p->head] + dy;
+  return TRUE;
+}
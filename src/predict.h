@@ -0,0 +1,35 @@
+
+#ifndef PREDICT_H
+#define PREDICT_H
+
+/*
+  Extrapolation of a pen stroke a few milliseconds ahead, so the ink can
+  be drawn up to where the pen most likely is by the time the frame is
+  shown. Fits position over the last samples as a quadratic in time and
+  follows the resulting velocity and damped acceleration from the newest
+  sample on.
+*/
+
+#include <glib.h>
+
+/* samples kept, and how old they may get compared to the newest one */
+#define PREDICT_POINTS 8
+#define PREDICT_WINDOW_MS 40
+
+typedef struct
+{
+  gdouble x[PREDICT_POINTS];
+  gdouble y[PREDICT_POINTS];
+  guint32 time[PREDICT_POINTS];
+  /* index of the newest sample and number of samples */
+  guint   head;
+  guint   n;
+} GromitPredictor;
+
+void predictor_reset (GromitPredictor *p);
+/* add a sample at server time 'time' in ms, older than the newest one are dropped */
+void predictor_add (GromitPredictor *p, gdouble x, gdouble y, guint32 time);
+/* where the pen is 'horizon' ms after the newest sample, FALSE if there is too little to go by */
+gboolean predictor_predict (const GromitPredictor *p, guint horizon, gdouble *x, gdouble *y);
+
+#endif
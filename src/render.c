@@ -0,0 +1,84 @@
+
+#include "render.h"
+#include "main.h"
+#include "drawing.h"
+#include "callbacks.h"
+
+/* print coalescing statistics every this many frames in debug mode */
+#define DAMAGE_STATS_INTERVAL 120
+
+
+/*
+ * Runs in the update phase of the frame clock, i.e. once per frame right
+ * before painting.
+ */
+static gboolean on_frame_tick (GtkWidget     *widget,
+			       GdkFrameClock *frame_clock,
+			       gpointer       user_data)
+{
+  GromitData *data = (GromitData *) user_data;
+
+  data->frame_tick_id = 0;
+  process_all_motion (data);
+  damage_flush (data);
+
+  return G_SOURCE_REMOVE;
+}
+
+
+/*
+ * Make sure on_frame_tick() runs on the next frame.
+ */
+void render_request_frame (GromitData *data)
+{
+  if (!data->frame_tick_id)
+    data->frame_tick_id = gtk_widget_add_tick_callback (data->win, on_frame_tick,
+							data, NULL);
+}
+
+
+/*
+ * Remember that 'rect' needs a repaint. The actual invalidation happens on
+ * the next frame clock tick, merged with everything else drawn until then.
+ */
+void damage_add_rect (GromitData *data,
+		      const GdkRectangle *rect)
+{
+  cairo_region_union_rectangle (data->damage, rect);
+  data->damage_rects++;
+
+  render_request_frame (data);
+}
+
+
+/*
+ * Rasterize pending strokes and invalidate everything accumulated so far
+ * in one go.
+ */
+void damage_flush (GromitData *data)
+{
+  draw_flush_frame (data);
+
+  if (cairo_region_is_empty (data->damage))
+    return;
+
+  data->damage_flushes++;
+  data->damage_flushed_rects += cairo_region_num_rectangles (data->damage);
+
+  gdk_window_invalidate_region (gtk_widget_get_window (data->win), data->damage, FALSE);
+
+  cairo_region_destroy (data->damage);
+  data->damage = cairo_region_create ();
+
+  if (data->debug && data->damage_flushes % DAMAGE_STATS_INTERVAL == 0)
+    damage_print_stats (data);
+}
+
+
+void damage_print_stats (GromitData *data)
+{
+  g_printerr ("DEBUG: damage: %" G_GUINT64_FORMAT " rects coalesced into %" G_GUINT64_FORMAT
+	      " rects in %" G_GUINT64_FORMAT " frames (%.1f invalidations per frame)\n",
+	      data->damage_rects, data->damage_flushed_rects, data->damage_flushes,
+	      data->damage_flushes ? (double) data->damage_flushed_rects / data->damage_flushes : 0.0);
+}
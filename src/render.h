@@ -0,0 +1,20 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+/*
+  Per-frame rendering.
+  Input handlers only queue motion samples and drawing functions do not
+  invalidate the window themselves but report the area they touched here.
+  Once per frame clock tick, the queued samples are rasterized and the
+  accumulated damage is handed to GDK.
+*/
+
+#include "main.h"
+
+void render_request_frame (GromitData *data);
+
+void damage_add_rect (GromitData *data, const GdkRectangle *rect);
+void damage_flush (GromitData *data);
+void damage_print_stats (GromitData *data);
+
+#endif
@@ -0,0 +1,110 @@
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "rle.h"
+
+
+/*
+ * Number of transparent pixels at the start of the 'n' pixels at 'p'.
+ */
+static guint zero_run (const guint32 *p,
+		       guint n)
+{
+  guint i = 0;
+
+#ifdef __SSE2__
+  /* four pixels per compare, most of a tile is transparent */
+  const __m128i zero = _mm_setzero_si128 ();
+  for (; i + 4 <= n; i += 4)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (p + i));
+      guint mask = _mm_movemask_epi8 (_mm_cmpeq_epi32 (v, zero));
+      if (mask != 0xffff)
+	return i + __builtin_ctz (~mask) / 4;
+    }
+#endif
+
+  while (i < n && p[i] == 0)
+    i++;
+  return i;
+}
+
+
+static guint ink_run (const guint32 *p,
+		      guint n)
+{
+  guint i = 0;
+  while (i < n && p[i] != 0)
+    i++;
+  return i;
+}
+
+
+gsize rle_encode (const guint32 *pixels,
+		  guint width,
+		  guint height,
+		  guchar *out)
+{
+  guchar *o = out;
+
+  for (guint y = 0; y < height; y++)
+    {
+      const guint32 *row = pixels + (gsize) y * width;
+      guint x = 0;
+
+      /* a fully transparent row is a single empty span */
+      do
+	{
+	  guint16 span[2];
+	  span[0] = zero_run (row + x, width - x);
+	  x += span[0];
+	  span[1] = ink_run (row + x, width - x);
+
+	  memcpy (o, span, sizeof (span));
+	  memcpy (o + sizeof (span), row + x, span[1] * 4);
+	  o += sizeof (span) + span[1] * 4;
+	  x += span[1];
+	}
+      while (x < width);
+    }
+
+  return o - out;
+}
+
+
+gboolean rle_decode (const guchar *in,
+		     gsize length,
+		     guint32 *pixels,
+		     guint width,
+		     guint height)
+{
+  const guchar *end = in + length;
+
+  for (guint y = 0; y < height; y++)
+    {
+      guint32 *row = pixels + (gsize) y * width;
+      guint x = 0;
+
+      do
+	{
+	  guint16 span[2];
+	  if (end - in < (gssize) sizeof (span))
+	    return FALSE;
+	  memcpy (span, in, sizeof (span));
+	  in += sizeof (span);
+
+	  if (span[0] + span[1] > width - x || end - in < span[1] * 4)
+	    return FALSE;
+	  memset (row + x, 0, span[0] * 4);
+	  x += span[0];
+	  memcpy (row + x, in, span[1] * 4);
+	  in += span[1] * 4;
+	  x += span[1];
+	}
+      while (x < width);
+    }
+
+  return in == end;
+}
@@ -0,0 +1,23 @@
+
+#ifndef RLE_H
+#define RLE_H
+
+/*
+  Run-length pre-pass for ARGB32 images that are mostly transparent.
+  Each row becomes a sequence of spans: the number of transparent (all
+  zero) pixels, the number of pixels following them, then these pixels.
+  Spans are two native-endian 16-bit counts, so rows are limited to 65535
+  pixels. A general-purpose compressor then only sees the inked parts.
+*/
+
+#include <glib.h>
+
+/* largest encoded size of a 'width' x 'height' image */
+#define RLE_BOUND(width, height) ((gsize) (height) * ((width) * 4 + 4))
+
+/* encode 'pixels', rows of 'width' pixels without padding, into 'out', returns the size */
+gsize rle_encode (const guint32 *pixels, guint width, guint height, guchar *out);
+/* the reverse, FALSE if 'in' does not decode to exactly that many pixels */
+gboolean rle_decode (const guchar *in, gsize length, guint32 *pixels, guint width, guint height);
+
+#endif
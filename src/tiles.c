@@ -0,0 +1,603 @@
+
+#include <math.h>
+#include <string.h>
+#include "tiles.h"
+
+
+/*
+ * iterate over all tiles overlapping 'area', which must be non-empty
+ */
+#define FOREACH_TILE(ts, area, col, row, idx)				\
+  for (guint row = MAX ((area)->y, 0) / GROMIT_TILE_SIZE;		\
+       row < (ts)->rows && (gint) (row * GROMIT_TILE_SIZE) < (area)->y + (area)->height; \
+       row++)								\
+    for (guint col = MAX ((area)->x, 0) / GROMIT_TILE_SIZE, idx = row * (ts)->cols + col; \
+	 col < (ts)->cols && (gint) (col * GROMIT_TILE_SIZE) < (area)->x + (area)->width; \
+	 col++, idx++)
+
+
+static void tile_rect (guint col, guint row, GdkRectangle *rect)
+{
+  rect->x = col * GROMIT_TILE_SIZE;
+  rect->y = row * GROMIT_TILE_SIZE;
+  rect->width = GROMIT_TILE_SIZE;
+  rect->height = GROMIT_TILE_SIZE;
+}
+
+
+static void tile_mark_dirty (GromitTiledSurface *ts, guint idx)
+{
+  if (!ts->dirty[idx])
+    {
+      ts->dirty[idx] = 1;
+      ts->n_dirty++;
+    }
+}
+
+
+static void tile_will_change (GromitTiledSurface *ts, guint idx)
+{
+  guint32 previous = ts->written[idx];
+
+  if (previous == ts->writer)
+    return;
+  ts->written[idx] = ts->writer;
+  if (ts->write_hook)
+    ts->write_hook (ts, idx, previous == 0, ts->write_hook_data);
+}
+
+
+/*
+ * After tile_will_change(), so that the write hook sees the old version.
+ */
+static void tile_bump_version (GromitTiledSurface *ts, guint idx)
+{
+  ts->version[idx] = ++ts->n_writes;
+}
+
+
+static cairo_surface_t *tile_alloc (GromitTiledSurface *ts, guint idx)
+{
+  if (!ts->tiles[idx])
+    {
+      /* image surfaces start out fully transparent */
+      ts->tiles[idx] = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+						   GROMIT_TILE_SIZE, GROMIT_TILE_SIZE);
+      ts->n_allocated++;
+    }
+  return ts->tiles[idx];
+}
+
+
+static void tile_free (GromitTiledSurface *ts, guint idx)
+{
+  if (ts->tiles[idx])
+    {
+      tile_will_change (ts, idx);
+      tile_bump_version (ts, idx);
+      cairo_surface_destroy (ts->tiles[idx]);
+      ts->tiles[idx] = NULL;
+      ts->n_allocated--;
+      tile_mark_dirty (ts, idx);
+    }
+}
+
+
+static gboolean tile_is_empty (cairo_surface_t *tile)
+{
+  cairo_surface_flush (tile);
+  const guint64 *p = (const guint64 *) cairo_image_surface_get_data (tile);
+  const guint64 *end = p + GROMIT_TILE_BYTES / sizeof (guint64);
+
+  /* usually returns at the first word when there is ink left */
+  while (p < end)
+    if (*p++)
+      return FALSE;
+  return TRUE;
+}
+
+
+/*
+ * Whether drawing with 'op' onto a transparent tile can produce ink. If not,
+ * empty tiles are skipped instead of being allocated.
+ */
+static gboolean operator_adds_ink (cairo_operator_t op)
+{
+  switch (op)
+    {
+    case CAIRO_OPERATOR_CLEAR:
+    case CAIRO_OPERATOR_IN:
+    case CAIRO_OPERATOR_ATOP:
+    case CAIRO_OPERATOR_DEST:
+    case CAIRO_OPERATOR_DEST_IN:
+    case CAIRO_OPERATOR_DEST_OUT:
+    case CAIRO_OPERATOR_DEST_ATOP:
+      return FALSE;
+    default:
+      return TRUE;
+    }
+}
+
+
+/*
+ * Clear what lies outside of the surface bounds in the last column and row,
+ * so that nothing stale shows up when the surface grows again.
+ */
+static void clear_outside_bounds (GromitTiledSurface *ts)
+{
+  guint last_col_w = ts->width - (ts->cols - 1) * GROMIT_TILE_SIZE;
+  guint last_row_h = ts->height - (ts->rows - 1) * GROMIT_TILE_SIZE;
+
+  for (guint row = 0; row < ts->rows; row++)
+    for (guint col = 0; col < ts->cols; col++)
+      {
+	cairo_surface_t *tile = ts->tiles[row * ts->cols + col];
+	if (!tile || (col != ts->cols - 1 && row != ts->rows - 1))
+	  continue;
+
+	cairo_t *cr = cairo_create (tile);
+	cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+	if (col == ts->cols - 1 && last_col_w < GROMIT_TILE_SIZE)
+	  cairo_rectangle (cr, last_col_w, 0, GROMIT_TILE_SIZE - last_col_w, GROMIT_TILE_SIZE);
+	if (row == ts->rows - 1 && last_row_h < GROMIT_TILE_SIZE)
+	  cairo_rectangle (cr, 0, last_row_h, GROMIT_TILE_SIZE, GROMIT_TILE_SIZE - last_row_h);
+	cairo_fill (cr);
+	cairo_destroy (cr);
+      }
+}
+
+
+GromitTiledSurface *tiled_surface_new (guint width, guint height)
+{
+  GromitTiledSurface *ts = g_malloc0 (sizeof (GromitTiledSurface));
+
+  ts->width = width;
+  ts->height = height;
+  ts->cols = (width + GROMIT_TILE_SIZE - 1) / GROMIT_TILE_SIZE;
+  ts->rows = (height + GROMIT_TILE_SIZE - 1) / GROMIT_TILE_SIZE;
+  ts->tiles = g_malloc0 (ts->cols * ts->rows * sizeof (cairo_surface_t *));
+  ts->dirty = g_malloc0 (ts->cols * ts->rows);
+  ts->written = g_malloc0 (ts->cols * ts->rows * sizeof (guint32));
+  ts->writer = 1;
+  ts->version = g_malloc0 (ts->cols * ts->rows * sizeof (guint64));
+  ts->region = cairo_region_create ();
+  ts->proxy = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 1, 1);
+
+  return ts;
+}
+
+
+void tiled_surface_free (GromitTiledSurface *ts)
+{
+  if (!ts)
+    return;
+
+  ts->write_hook = NULL;
+  tiled_surface_clear (ts);
+  cairo_surface_destroy (ts->proxy);
+  cairo_region_destroy (ts->region);
+  g_free (ts->dirty);
+  g_free (ts->written);
+  g_free (ts->version);
+  g_free (ts->tiles);
+  g_free (ts);
+}
+
+
+/*
+ * Change the size, keeping the contents that are still inside.
+ */
+void tiled_surface_resize (GromitTiledSurface *ts, guint width, guint height)
+{
+  guint cols = (width + GROMIT_TILE_SIZE - 1) / GROMIT_TILE_SIZE;
+  guint rows = (height + GROMIT_TILE_SIZE - 1) / GROMIT_TILE_SIZE;
+  cairo_surface_t **tiles = g_malloc0 (cols * rows * sizeof (cairo_surface_t *));
+  guint n_allocated = 0;
+
+  for (guint row = 0; row < ts->rows; row++)
+    for (guint col = 0; col < ts->cols; col++)
+      {
+	guint idx = row * ts->cols + col;
+	if (row < rows && col < cols)
+	  {
+	    tiles[row * cols + col] = ts->tiles[idx];
+	    if (ts->tiles[idx])
+	      n_allocated++;
+	  }
+	else if (ts->tiles[idx])
+	  cairo_surface_destroy (ts->tiles[idx]);
+      }
+
+  g_free (ts->tiles);
+  ts->tiles = tiles;
+  ts->n_allocated = n_allocated;
+  ts->width = width;
+  ts->height = height;
+  ts->cols = cols;
+  ts->rows = rows;
+
+  clear_outside_bounds (ts);
+
+  g_free (ts->written);
+  ts->written = g_malloc0 (cols * rows * sizeof (guint32));
+
+  /* tiles moved, so all of them count as changed */
+  g_free (ts->version);
+  ts->version = g_malloc (cols * rows * sizeof (guint64));
+  for (guint i = 0; i < cols * rows; i++)
+    ts->version[i] = ++ts->n_writes;
+
+  /* tiles moved, rescan all of them */
+  g_free (ts->dirty);
+  ts->dirty = g_malloc (cols * rows);
+  memset (ts->dirty, 1, cols * rows);
+  ts->n_dirty = cols * rows;
+  cairo_region_destroy (ts->region);
+  ts->region = cairo_region_create ();
+}
+
+
+void tiled_surface_clear_tile (GromitTiledSurface *ts, guint index)
+{
+  tile_free (ts, index);
+}
+
+
+void tiled_surface_clear (GromitTiledSurface *ts)
+{
+  for (guint i = 0; i < tiled_surface_n_tiles (ts); i++)
+    tile_free (ts, i);
+}
+
+
+/*
+ * Make 'dst' a copy of 'src'. Both must have the same size.
+ */
+void tiled_surface_copy (GromitTiledSurface *dst, GromitTiledSurface *src)
+{
+  g_return_if_fail (dst->cols == src->cols && dst->rows == src->rows);
+
+  for (guint i = 0; i < tiled_surface_n_tiles (src); i++)
+    tiled_surface_copy_tile (dst, src, i);
+}
+
+
+static void render_path (GromitTiledSurface *ts, cairo_t *ctx, gboolean fill)
+{
+  gdouble x1, y1, x2, y2;
+  if (fill)
+    cairo_fill_extents (ctx, &x1, &y1, &x2, &y2);
+  else
+    cairo_stroke_extents (ctx, &x1, &y1, &x2, &y2);
+
+  if (x2 <= x1 || y2 <= y1)
+    {
+      cairo_new_path (ctx);
+      return;
+    }
+
+  /* one pixel of slack for antialiasing */
+  GdkRectangle area;
+  area.x = floor (x1) - 1;
+  area.y = floor (y1) - 1;
+  area.width = ceil (x2) - area.x + 1;
+  area.height = ceil (y2) - area.y + 1;
+
+  cairo_operator_t op = cairo_get_operator (ctx);
+  gboolean adds_ink = operator_adds_ink (op);
+  cairo_path_t *path = cairo_copy_path (ctx);
+  cairo_new_path (ctx);
+
+  FOREACH_TILE (ts, &area, col, row, idx)
+    {
+      if (!ts->tiles[idx] && !adds_ink)
+	continue;
+
+      tile_will_change (ts, idx);
+      tile_bump_version (ts, idx);
+      cairo_t *cr = cairo_create (tile_alloc (ts, idx));
+      cairo_translate (cr, - (gdouble) (col * GROMIT_TILE_SIZE), - (gdouble) (row * GROMIT_TILE_SIZE));
+      cairo_set_source (cr, cairo_get_source (ctx));
+      cairo_set_operator (cr, op);
+      cairo_set_antialias (cr, cairo_get_antialias (ctx));
+      cairo_set_tolerance (cr, cairo_get_tolerance (ctx));
+      cairo_set_fill_rule (cr, cairo_get_fill_rule (ctx));
+      cairo_set_line_width (cr, cairo_get_line_width (ctx));
+      cairo_set_line_cap (cr, cairo_get_line_cap (ctx));
+      cairo_set_line_join (cr, cairo_get_line_join (ctx));
+      cairo_append_path (cr, path);
+      if (fill)
+	cairo_fill (cr);
+      else
+	cairo_stroke (cr);
+      cairo_destroy (cr);
+
+      tile_mark_dirty (ts, idx);
+      if (!adds_ink && tile_is_empty (ts->tiles[idx]))
+	tile_free (ts, idx);
+    }
+
+  cairo_path_destroy (path);
+}
+
+
+void tiled_surface_stroke (GromitTiledSurface *ts, cairo_t *ctx)
+{
+  render_path (ts, ctx, FALSE);
+}
+
+
+void tiled_surface_fill (GromitTiledSurface *ts, cairo_t *ctx)
+{
+  render_path (ts, ctx, TRUE);
+}
+
+
+guint64 tiled_surface_paint (GromitTiledSurface *ts, cairo_t *cr, const GdkRectangle *area)
+{
+  guint64 bytes = 0;
+
+  if (area->width <= 0 || area->height <= 0)
+    return 0;
+
+  cairo_save (cr);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+
+  /* whatever is not covered by an allocated tile is transparent */
+  cairo_region_t *empty = cairo_region_create_rectangle (area);
+  FOREACH_TILE (ts, area, col, row, idx)
+    if (ts->tiles[idx])
+      {
+	GdkRectangle rect;
+	tile_rect (col, row, &rect);
+	cairo_region_subtract_rectangle (empty, &rect);
+      }
+  if (!cairo_region_is_empty (empty))
+    {
+      cairo_set_source_rgba (cr, 0, 0, 0, 0);
+      for (int i = 0; i < cairo_region_num_rectangles (empty); i++)
+	{
+	  GdkRectangle rect;
+	  cairo_region_get_rectangle (empty, i, &rect);
+	  cairo_rectangle (cr, rect.x, rect.y, rect.width, rect.height);
+	}
+      cairo_fill (cr);
+    }
+  cairo_region_destroy (empty);
+
+  FOREACH_TILE (ts, area, col, row, idx)
+    if (ts->tiles[idx])
+      {
+	GdkRectangle rect, part;
+	tile_rect (col, row, &rect);
+	gdk_rectangle_intersect (area, &rect, &part);
+	cairo_set_source_surface (cr, ts->tiles[idx], rect.x, rect.y);
+	cairo_rectangle (cr, part.x, part.y, part.width, part.height);
+	cairo_fill (cr);
+	bytes += (guint64) part.width * part.height * 4;
+      }
+
+  cairo_restore (cr);
+  return bytes;
+}
+
+
+void tiled_surface_paint_over (GromitTiledSurface *ts,
+			       cairo_t *cr,
+			       const GdkRectangle *area,
+			       gdouble alpha)
+{
+  if (area->width <= 0 || area->height <= 0)
+    return;
+
+  FOREACH_TILE (ts, area, col, row, idx)
+    if (ts->tiles[idx])
+      {
+	GdkRectangle rect, part;
+	tile_rect (col, row, &rect);
+	gdk_rectangle_intersect (area, &rect, &part);
+	cairo_save (cr);
+	cairo_rectangle (cr, part.x, part.y, part.width, part.height);
+	cairo_clip (cr);
+	cairo_set_source_surface (cr, ts->tiles[idx], rect.x, rect.y);
+	cairo_paint_with_alpha (cr, alpha);
+	cairo_restore (cr);
+      }
+}
+
+
+void tiled_surface_composite (GromitTiledSurface *dst,
+			      GromitTiledSurface *src,
+			      gdouble alpha)
+{
+  g_return_if_fail (dst->cols == src->cols && dst->rows == src->rows);
+
+  for (guint idx = 0; idx < tiled_surface_n_tiles (src); idx++)
+    {
+      if (!src->tiles[idx])
+	continue;
+
+      tile_will_change (dst, idx);
+      tile_bump_version (dst, idx);
+      cairo_t *cr = cairo_create (tile_alloc (dst, idx));
+      cairo_set_source_surface (cr, src->tiles[idx], 0, 0);
+      cairo_paint_with_alpha (cr, alpha);
+      cairo_destroy (cr);
+
+      tile_mark_dirty (dst, idx);
+    }
+}
+
+
+cairo_region_t *tiled_surface_create_region (GromitTiledSurface *ts)
+{
+  for (guint idx = 0; ts->n_dirty > 0 && idx < tiled_surface_n_tiles (ts); idx++)
+    {
+      if (!ts->dirty[idx])
+	continue;
+
+      GdkRectangle rect;
+      tile_rect (idx % ts->cols, idx / ts->cols, &rect);
+      cairo_region_subtract_rectangle (ts->region, &rect);
+
+      if (ts->tiles[idx])
+	{
+	  cairo_region_t *r = gdk_cairo_region_create_from_surface (ts->tiles[idx]);
+	  cairo_region_translate (r, rect.x, rect.y);
+	  cairo_region_union (ts->region, r);
+	  cairo_region_destroy (r);
+	}
+
+      ts->dirty[idx] = 0;
+      ts->n_dirty--;
+    }
+
+  return cairo_region_copy (ts->region);
+}
+
+
+/*
+ * Pixel data of a tile, or NULL if the tile is empty.
+ */
+const guchar *tiled_surface_get_tile_data (GromitTiledSurface *ts, guint index)
+{
+  if (!ts->tiles[index])
+    return NULL;
+  cairo_surface_flush (ts->tiles[index]);
+  return cairo_image_surface_get_data (ts->tiles[index]);
+}
+
+
+/*
+ * Pixel data of a tile for writing, allocating it if needed. Must be
+ * followed by tiled_surface_end_tile_write().
+ */
+guchar *tiled_surface_begin_tile_write (GromitTiledSurface *ts, guint index)
+{
+  tile_will_change (ts, index);
+  tile_bump_version (ts, index);
+  cairo_surface_t *tile = tile_alloc (ts, index);
+  cairo_surface_flush (tile);
+  return cairo_image_surface_get_data (tile);
+}
+
+
+void tiled_surface_end_tile_write (GromitTiledSurface *ts, guint index)
+{
+  cairo_surface_mark_dirty (ts->tiles[index]);
+  tile_mark_dirty (ts, index);
+}
+
+
+void tiled_surface_set_write_hook (GromitTiledSurface *ts,
+				   GromitTileWriteHook hook,
+				   gpointer user_data)
+{
+  ts->write_hook = hook;
+  ts->write_hook_data = user_data;
+}
+
+
+void tiled_surface_reset_written (GromitTiledSurface *ts)
+{
+  memset (ts->written, 0, tiled_surface_n_tiles (ts) * sizeof (guint32));
+}
+
+
+void tiled_surface_set_writer (GromitTiledSurface *ts,
+			       guint32 writer)
+{
+  g_return_if_fail (writer != 0);
+  ts->writer = writer;
+}
+
+
+cairo_surface_t *tiled_surface_swap_tile (GromitTiledSurface *ts,
+					  guint index,
+					  cairo_surface_t *tile)
+{
+  cairo_surface_t *old = ts->tiles[index];
+
+  tile_will_change (ts, index);
+  tile_bump_version (ts, index);
+  ts->tiles[index] = tile;
+  if (old)
+    ts->n_allocated--;
+  if (tile)
+    ts->n_allocated++;
+  tile_mark_dirty (ts, index);
+
+  return old;
+}
+
+
+void tiled_surface_copy_tile (GromitTiledSurface *dst,
+			      GromitTiledSurface *src,
+			      guint index)
+{
+  const guchar *src_data = tiled_surface_get_tile_data (src, index);
+  if (!src_data)
+    {
+      tile_free (dst, index);
+      return;
+    }
+  memcpy (tiled_surface_begin_tile_write (dst, index), src_data, GROMIT_TILE_BYTES);
+  tiled_surface_end_tile_write (dst, index);
+}
+
+
+void tiled_surface_capture_area (GromitTiledSurface *ts,
+				 GromitTiledSurface *snapshot,
+				 guint8 *copied,
+				 const GdkRectangle *area)
+{
+  g_return_if_fail (ts->cols == snapshot->cols && ts->rows == snapshot->rows);
+
+  if (area->width <= 0 || area->height <= 0)
+    return;
+
+  FOREACH_TILE (ts, area, col, row, idx)
+    if (!copied[idx])
+      {
+	tiled_surface_copy_tile (snapshot, ts, idx);
+	copied[idx] = 1;
+      }
+}
+
+
+void tiled_surface_restore_area (GromitTiledSurface *ts,
+				 GromitTiledSurface *snapshot,
+				 const guint8 *copied,
+				 const GdkRectangle *area)
+{
+  g_return_if_fail (ts->cols == snapshot->cols && ts->rows == snapshot->rows);
+
+  if (area->width <= 0 || area->height <= 0)
+    return;
+
+  FOREACH_TILE (ts, area, col, row, idx)
+    {
+      const guchar *src_data = tiled_surface_get_tile_data (snapshot, idx);
+      GdkRectangle rect, part;
+
+      if (!copied[idx] || (!src_data && !ts->tiles[idx]))
+	continue;
+
+      tile_rect (col, row, &rect);
+      gdk_rectangle_intersect (area, &rect, &part);
+
+      guchar *dst_data = tiled_surface_begin_tile_write (ts, idx);
+      gsize offset = (part.y - rect.y) * GROMIT_TILE_STRIDE + (part.x - rect.x) * 4;
+      for (gint y = 0; y < part.height; y++, offset += GROMIT_TILE_STRIDE)
+	{
+	  if (src_data)
+	    memcpy (dst_data + offset, src_data + offset, part.width * 4);
+	  else
+	    memset (dst_data + offset, 0, part.width * 4);
+	}
+      tiled_surface_end_tile_write (ts, idx);
+
+      if (!src_data && tile_is_empty (ts->tiles[idx]))
+	tile_free (ts, idx);
+    }
+}
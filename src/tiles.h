@@ -0,0 +1,118 @@
+#ifndef TILES_H
+#define TILES_H
+
+/*
+  Sparse tiled ARGB32 surface.
+  The surface is split into fixed-size square tiles. A tile is only allocated
+  once something gets painted on it and is freed again when it is cleared,
+  so memory use follows the inked area instead of the screen size.
+*/
+
+#include <glib.h>
+#include <gdk/gdk.h>
+
+#define GROMIT_TILE_SIZE  256
+#define GROMIT_TILE_STRIDE (GROMIT_TILE_SIZE * 4)
+#define GROMIT_TILE_BYTES (GROMIT_TILE_STRIDE * GROMIT_TILE_SIZE)
+
+typedef struct _GromitTiledSurface GromitTiledSurface;
+
+/* called before a tile is modified for the first time, see below */
+typedef void (*GromitTileWriteHook) (GromitTiledSurface *ts, guint index,
+				     gboolean first, gpointer user_data);
+
+struct _GromitTiledSurface
+{
+  guint            width;
+  guint            height;
+  guint            cols;
+  guint            rows;
+  /* cols * rows entries, row-major, NULL for empty tiles */
+  cairo_surface_t **tiles;
+  guint            n_allocated;
+  /* opaque area, kept up to date by rescanning only dirty tiles */
+  cairo_region_t  *region;
+  guint8          *dirty;
+  guint            n_dirty;
+  /* per tile, the last writer since tiled_surface_reset_written(), 0 if none */
+  guint32         *written;
+  guint32          writer;
+  /* per tile, changes whenever the tile does, never repeats */
+  guint64         *version;
+  guint64          n_writes;
+  GromitTileWriteHook write_hook;
+  gpointer         write_hook_data;
+  /*
+    1x1 dummy surface. Paint contexts are created on it: they only hold the
+    drawing state and the current path, the actual rendering is done by
+    tiled_surface_stroke() and tiled_surface_fill().
+  */
+  cairo_surface_t *proxy;
+};
+
+
+GromitTiledSurface *tiled_surface_new (guint width, guint height);
+void tiled_surface_free (GromitTiledSurface *ts);
+void tiled_surface_resize (GromitTiledSurface *ts, guint width, guint height);
+
+void tiled_surface_clear (GromitTiledSurface *ts);
+void tiled_surface_clear_tile (GromitTiledSurface *ts, guint index);
+void tiled_surface_copy (GromitTiledSurface *dst, GromitTiledSurface *src);
+
+/*
+  Snapshot-on-write: the hook runs right before the first modification of a
+  tile since the last tiled_surface_reset_written(), while the tile still
+  has its old contents. 'first' is TRUE then.
+  Modifications are attributed to the writer set with
+  tiled_surface_set_writer(), 1 by default. The hook runs again, with
+  'first' FALSE, when a different writer modifies a tile.
+*/
+void tiled_surface_set_write_hook (GromitTiledSurface *ts, GromitTileWriteHook hook, gpointer user_data);
+void tiled_surface_reset_written (GromitTiledSurface *ts);
+void tiled_surface_set_writer (GromitTiledSurface *ts, guint32 writer);
+
+/* put 'tile' in place of tile 'index' and hand over the old one, NULL is empty */
+cairo_surface_t *tiled_surface_swap_tile (GromitTiledSurface *ts, guint index, cairo_surface_t *tile);
+/* copy a single tile */
+void tiled_surface_copy_tile (GromitTiledSurface *dst, GromitTiledSurface *src, guint index);
+/*
+  copy the tiles of 'area' not set in 'copied' to 'snapshot' and set them,
+  'copied' has an entry per tile
+*/
+void tiled_surface_capture_area (GromitTiledSurface *ts, GromitTiledSurface *snapshot, guint8 *copied, const GdkRectangle *area);
+/* copy 'area' back from 'snapshot', limited to the tiles set in 'copied' */
+void tiled_surface_restore_area (GromitTiledSurface *ts, GromitTiledSurface *snapshot, const guint8 *copied, const GdkRectangle *area);
+
+/* render and consume the current path of 'ctx' using its drawing state */
+void tiled_surface_stroke (GromitTiledSurface *ts, cairo_t *ctx);
+void tiled_surface_fill (GromitTiledSurface *ts, cairo_t *ctx);
+
+/* paint 'area' of the surface to 'cr', returns the number of bytes copied */
+guint64 tiled_surface_paint (GromitTiledSurface *ts, cairo_t *cr, const GdkRectangle *area);
+/* paint the tiles of 'area' over what 'cr' holds, with 'alpha' */
+void tiled_surface_paint_over (GromitTiledSurface *ts, cairo_t *cr, const GdkRectangle *area, gdouble alpha);
+/* paint all of 'src' over 'dst' with 'alpha', a drawing operation on 'dst' */
+void tiled_surface_composite (GromitTiledSurface *dst, GromitTiledSurface *src, gdouble alpha);
+
+/*
+  region of all pixels that are more than 50% opaque, only tiles changed
+  since the last call are scanned
+*/
+cairo_region_t *tiled_surface_create_region (GromitTiledSurface *ts);
+
+/* raw access, used for (de)serialisation */
+const guchar *tiled_surface_get_tile_data (GromitTiledSurface *ts, guint index);
+guchar *tiled_surface_begin_tile_write (GromitTiledSurface *ts, guint index);
+void tiled_surface_end_tile_write (GromitTiledSurface *ts, guint index);
+
+static inline guint tiled_surface_n_tiles (const GromitTiledSurface *ts)
+{
+  return ts->cols * ts->rows;
+}
+
+static inline gsize tiled_surface_get_bytes (const GromitTiledSurface *ts)
+{
+  return (gsize) ts->n_allocated * GROMIT_TILE_BYTES;
+}
+
+#endif
@@ -0,0 +1,101 @@
+
+#include <signal.h>
+#include <glib-unix.h>
+#include "trace.h"
+
+/* a power of two, so the counter can wrap */
+#define TRACE_RING_SIZE 8192
+
+typedef struct
+{
+  /* position + 1 once the record is complete, 0 while it is written */
+  guint        seq;
+  guint8       level;
+  guint8       n_values;
+  gint64       time;
+  const gchar *func;
+  const gchar *msg;
+  gint64       values[2];
+} TraceRecord;
+
+gint trace_level = GROMIT_TRACE_INFO;
+
+static TraceRecord ring[TRACE_RING_SIZE];
+static guint ring_head;
+
+static const gchar *level_names[] = { "error", "info", "debug" };
+
+
+void trace_record (GromitTraceLevel level,
+		   const gchar *func,
+		   const gchar *msg,
+		   guint n_values,
+		   gint64 a,
+		   gint64 b)
+{
+  guint pos = (guint) g_atomic_int_add ((gint *) &ring_head, 1);
+  TraceRecord *r = &ring[pos % TRACE_RING_SIZE];
+
+  g_atomic_int_set ((gint *) &r->seq, 0);
+  r->level = level;
+  r->n_values = n_values;
+  r->time = g_get_monotonic_time ();
+  r->func = func;
+  r->msg = msg;
+  r->values[0] = a;
+  r->values[1] = b;
+  /* readers only take the record once this is set */
+  g_atomic_int_set ((gint *) &r->seq, pos + 1);
+}
+
+
+void trace_dump (FILE *out)
+{
+  guint head = (guint) g_atomic_int_get ((gint *) &ring_head);
+  guint start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+  gint64 now = g_get_monotonic_time ();
+
+  fprintf (out, "--- trace, %u records, newest last ---\n", head - start);
+  for (guint pos = start; pos != head; pos++)
+    {
+      TraceRecord *r = &ring[pos % TRACE_RING_SIZE];
+      TraceRecord copy;
+
+      /* skip records being written or overwritten meanwhile */
+      if ((guint) g_atomic_int_get ((gint *) &r->seq) != pos + 1)
+	continue;
+      copy = *r;
+      if ((guint) g_atomic_int_get ((gint *) &r->seq) != pos + 1)
+	continue;
+
+      fprintf (out, "%10.3f ms %-5s %s: %s",
+	       (copy.time - now) / 1000.0, level_names[copy.level], copy.func, copy.msg);
+      for (guint i = 0; i < copy.n_values; i++)
+	fprintf (out, " %" G_GINT64_FORMAT, copy.values[i]);
+      fputc ('\n', out);
+    }
+  fflush (out);
+}
+
+
+static gboolean on_sigusr1 (gpointer user_data)
+{
+  trace_dump (stderr);
+  return G_SOURCE_CONTINUE;
+}
+
+
+void trace_init (gboolean debug)
+{
+  const gchar *level = g_getenv ("GROMIT_TRACE");
+
+  if (debug)
+    trace_level = GROMIT_TRACE_DEBUG;
+  for (guint i = 0; level && i < G_N_ELEMENTS (level_names); i++)
+    if (g_ascii_strcasecmp (level, level_names[i]) == 0)
+      trace_level = i;
+  if (g_strcmp0 (level, "none") == 0)
+    trace_level = -1;
+
+  g_unix_signal_add (SIGUSR1, on_sigusr1, NULL);
+}
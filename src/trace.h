@@ -0,0 +1,56 @@
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+  Tracing into an in-memory ring buffer instead of printing.
+  A trace point records a static message, the function and up to two
+  numbers, formatting only happens when the ring is dumped with
+  trace_dump(), e.g. on SIGUSR1. Recording is lock-free, so any thread may
+  trace. The oldest records are overwritten once the ring is full.
+  Levels above GROMIT_TRACE_MAX_LEVEL are compiled out, the others cost a
+  predicted branch on trace_level unless enabled at runtime.
+*/
+
+#include <stdio.h>
+#include <glib.h>
+#include "build-config.h"
+
+typedef enum
+{
+  GROMIT_TRACE_ERROR,
+  GROMIT_TRACE_INFO,
+  GROMIT_TRACE_DEBUG
+} GromitTraceLevel;
+
+#ifndef GROMIT_TRACE_MAX_LEVEL
+#define GROMIT_TRACE_MAX_LEVEL GROMIT_TRACE_DEBUG
+#endif
+
+/* records at this level and below are kept, -1 for none */
+extern gint trace_level;
+
+#define TRACE2(level, msg, a, b)					\
+  G_STMT_START {							\
+    if ((level) <= GROMIT_TRACE_MAX_LEVEL && G_UNLIKELY ((gint) (level) <= trace_level)) \
+      trace_record ((level), G_STRFUNC, (msg), 2, (gint64) (a), (gint64) (b)); \
+  } G_STMT_END
+
+#define TRACE(level, msg)						\
+  G_STMT_START {							\
+    if ((level) <= GROMIT_TRACE_MAX_LEVEL && G_UNLIKELY ((gint) (level) <= trace_level)) \
+      trace_record ((level), G_STRFUNC, (msg), 0, 0, 0);		\
+  } G_STMT_END
+
+
+/* set trace_level from $GROMIT_TRACE (error, info or debug) and hook up SIGUSR1 */
+void trace_init (gboolean debug);
+
+/* 'func' and 'msg' have to be static strings */
+void trace_record (GromitTraceLevel level, const gchar *func, const gchar *msg,
+		   guint n_values, gint64 a, gint64 b);
+
+/* print the records in the ring, oldest first */
+void trace_dump (FILE *out);
+
+#endif
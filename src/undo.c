@@ -0,0 +1,1617 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include "undo.h"
+#include "drawing.h"
+#include "render.h"
+#include "journal.h"
+#include "rle.h"
+#include "codec.h"
+
+
+/* record types of the journal, new ones when the blob format changes */
+#define JOURNAL_BLOB  5
+#define JOURNAL_STATE 6
+/* a tile after the transparency pre-pass */
+#define PACKED_BOUND RLE_BOUND (GROMIT_TILE_SIZE, GROMIT_TILE_SIZE)
+/* delay to batch up changes before writing them to the journal */
+#define JOURNAL_DELAY_MS 250
+
+/*
+  Work for the worker thread, compressing a tile, or for the journal
+  thread, writing a state to the journal when 'state' is set.
+*/
+typedef struct
+{
+  /* holds a reference until the blob is filled in */
+  GromitUndoBlob *blob;
+  /* copy of the tile to compress, and the codec to use, taken when it is
+     queued since a config reload may change data->undo_codec meanwhile */
+  gchar          *raw;
+  const GromitCodec *codec;
+  /* see journal_build_state() */
+  GArray         *state;
+  GPtrArray      *state_blobs;
+  /* compressions queued before the state, which fill in its blobs */
+  guint64         after;
+} UndoJob;
+
+static void journal_write_state (GromitData *data, UndoJob *job);
+static GromitUndoBlob *tile_blob (GromitData *data, guint index, gboolean will_change);
+
+
+static GromitUndoBlob *blob_new (void)
+{
+  GromitUndoBlob *blob = g_new0 (GromitUndoBlob, 1);
+  blob->ref_count = 1;
+  return blob;
+}
+
+
+static GromitUndoBlob *blob_ref (GromitUndoBlob *blob)
+{
+  if (blob)
+    g_atomic_int_inc (&blob->ref_count);
+  return blob;
+}
+
+
+/*
+ * The worker drops its reference too, so this may run on either thread.
+ */
+static void blob_unref (GromitData *data,
+			GromitUndoBlob *blob)
+{
+  if (!blob || !g_atomic_int_dec_and_test (&blob->ref_count))
+    return;
+
+  g_mutex_lock (&data->undo_lock);
+  data->undo_bytes -= blob->size;
+  g_mutex_unlock (&data->undo_lock);
+
+  g_free (blob->data);
+  g_free (blob);
+}
+
+
+static void undo_tile_free (GromitData *data,
+			    GromitUndoTile *tile)
+{
+  blob_unref (data, tile->blob);
+  blob_unref (data, tile->post);
+  if (tile->raw)
+    cairo_surface_destroy (tile->raw);
+  g_free (tile);
+}
+
+
+/*
+ * The part of the budget the uncompressed tiles of undo_hot may use, the
+ * compressed entries get the rest.
+ */
+static gsize undo_raw_budget (GromitData *data)
+{
+  return data->undo_budget / GROMIT_UNDO_RAW_SHARE;
+}
+
+
+/*
+ * Drop the uncompressed copies of the tiles of 'entry', the blobs stay.
+ */
+static void entry_drop_raw (GromitData *data,
+			    GromitUndoEntry *entry)
+{
+  for (guint i = 0; entry->n_raw > 0 && i < entry->tiles->len; i++)
+    {
+      GromitUndoTile *tile = g_ptr_array_index (entry->tiles, i);
+      if (tile->raw)
+	{
+	  cairo_surface_destroy (tile->raw);
+	  tile->raw = NULL;
+	  entry->n_raw--;
+	}
+    }
+  g_queue_remove (&data->undo_hot, entry);
+}
+
+
+static void undo_command_free (gpointer p)
+{
+  GromitUndoCommand *cmd = p;
+  g_free (cmd->segments);
+  g_free (cmd);
+}
+
+
+static void undo_entry_free (GromitData *data,
+			     GromitUndoEntry *entry)
+{
+  if (!entry)
+    return;
+
+  if (entry->n_raw > 0)
+    g_queue_remove (&data->undo_hot, entry);
+  if (entry->tiles)
+    {
+      for (guint i = 0; i < entry->tiles->len; i++)
+	undo_tile_free (data, g_ptr_array_index (entry->tiles, i));
+      g_ptr_array_free (entry->tiles, TRUE);
+    }
+  if (entry->commands)
+    g_ptr_array_free (entry->commands, TRUE);
+
+  if (entry->region)
+    cairo_region_destroy (entry->region);
+
+  g_mutex_lock (&data->undo_lock);
+  data->undo_bytes -= entry->bytes;
+  g_mutex_unlock (&data->undo_lock);
+  if (data->undo_recording == entry)
+    data->undo_recording = NULL;
+  if (entry->owner && entry->owner->undo_recording == entry)
+    entry->owner->undo_recording = NULL;
+  g_free (entry);
+}
+
+
+/*
+ * Compress 'raw_data' into 'blob': runs of transparent pixels are encoded
+ * first, into 'packed' of PACKED_BOUND bytes, then 'codec' compresses what
+ * is left, using 'scratch' of 'scratch_size' bytes as intermediate buffer.
+ */
+static void compress_raw (GromitData *data,
+			  const GromitCodec *codec,
+			  const char *raw_data,
+			  GromitUndoBlob *blob,
+			  char *packed,
+			  char *scratch,
+			  size_t scratch_size)
+{
+  gsize packed_size = rle_encode ((const guint32 *) raw_data, GROMIT_TILE_SIZE, GROMIT_TILE_SIZE,
+				  (guchar *) packed);
+  gsize size = codec->compress (packed, packed_size, scratch, scratch_size);
+
+  /* cannot happen with a large enough scratch, but keep the data anyway */
+  if (size == 0)
+    {
+      codec = codec_by_id (GROMIT_CODEC_RAW);
+      size = codec->compress (packed, packed_size, scratch, scratch_size);
+    }
+
+  gchar *compressed = g_malloc (size);
+  memcpy (compressed, scratch, size);
+
+  g_mutex_lock (&data->undo_lock);
+  blob->codec = codec->id;
+  blob->size = size;
+  blob->data = compressed;
+  data->undo_bytes += size;
+  g_mutex_unlock (&data->undo_lock);
+}
+
+
+/*
+ * The compressed blob of what tile 'index' of the backbuffer holds now, if
+ * it is known and the tile has not changed since.
+ */
+static GromitUndoBlob *cache_lookup (GromitData *data,
+				     guint index)
+{
+  if (index >= data->undo_cache_size ||
+      data->undo_cache_version[index] != data->backbuffer->version[index])
+    return NULL;
+  return data->undo_cache[index];
+}
+
+
+static void cache_store (GromitData *data,
+			 guint index,
+			 GromitUndoBlob *blob)
+{
+  if (data->undo_cache_size != tiled_surface_n_tiles (data->backbuffer))
+    {
+      for (guint i = 0; i < data->undo_cache_size; i++)
+	blob_unref (data, data->undo_cache[i]);
+      g_free (data->undo_cache);
+      g_free (data->undo_cache_version);
+      data->undo_cache_size = tiled_surface_n_tiles (data->backbuffer);
+      data->undo_cache = g_new0 (GromitUndoBlob *, data->undo_cache_size);
+      data->undo_cache_version = g_new0 (guint64, data->undo_cache_size);
+    }
+
+  blob_ref (blob);
+  blob_unref (data, data->undo_cache[index]);
+  data->undo_cache[index] = blob;
+  data->undo_cache_version[index] = data->backbuffer->version[index];
+}
+
+
+static void cache_clear (GromitData *data)
+{
+  for (guint i = 0; i < data->undo_cache_size; i++)
+    blob_unref (data, data->undo_cache[i]);
+  g_free (data->undo_cache);
+  g_free (data->undo_cache_version);
+  data->undo_cache = NULL;
+  data->undo_cache_version = NULL;
+  data->undo_cache_size = 0;
+}
+
+
+static gpointer undo_worker (gpointer user_data)
+{
+  GromitData *data = (GromitData *) user_data;
+  size_t scratch_size = 0;
+  char *scratch = NULL;
+  char *packed = g_malloc (PACKED_BOUND);
+
+  for (;;)
+    {
+      UndoJob *job = g_async_queue_pop (data->undo_queue);
+
+      const GromitCodec *codec = job->codec;
+      if (codec->bound (PACKED_BOUND) > scratch_size)
+	{
+	  scratch_size = codec->bound (PACKED_BOUND);
+	  scratch = g_realloc (scratch, scratch_size);
+	}
+      compress_raw (data, codec, job->raw, job->blob, packed, scratch, scratch_size);
+      g_free (job->raw);
+      blob_unref (data, job->blob);
+
+      g_mutex_lock (&data->undo_lock);
+      data->undo_done++;
+      g_cond_broadcast (&data->undo_cond);
+      g_mutex_unlock (&data->undo_lock);
+
+      g_free (job);
+    }
+
+  return NULL;
+}
+
+
+/*
+ * Writes states to the journal, apart from the worker so that neither
+ * compression nor drawing ever waits for the disk.
+ */
+static gpointer journal_worker (gpointer user_data)
+{
+  GromitData *data = (GromitData *) user_data;
+
+  for (;;)
+    {
+      UndoJob *job = g_async_queue_pop (data->undo_journal_queue);
+
+      g_mutex_lock (&data->undo_lock);
+      while (data->undo_done < job->after)
+	g_cond_wait (&data->undo_cond, &data->undo_lock);
+      g_mutex_unlock (&data->undo_lock);
+
+      journal_write_state (data, job);
+      g_free (job);
+    }
+
+  return NULL;
+}
+
+
+/*
+ * Wait until the worker has compressed everything handed to it.
+ */
+void undo_wait (GromitData *data)
+{
+  g_mutex_lock (&data->undo_lock);
+  while (data->undo_done < data->undo_queued)
+    g_cond_wait (&data->undo_cond, &data->undo_lock);
+  g_mutex_unlock (&data->undo_lock);
+}
+
+
+/*
+ * Decompress 'blob' into the tile sized 'dest', NULL is an empty tile.
+ * Returns FALSE if the blob does not decode.
+ */
+static gboolean blob_decode (GromitUndoBlob *blob,
+			     gpointer dest)
+{
+  if (!blob)
+    {
+      memset (dest, 0, GROMIT_TILE_BYTES);
+      return TRUE;
+    }
+
+  const GromitCodec *codec = codec_by_id (blob->codec);
+  char *packed = g_malloc (PACKED_BOUND);
+  gssize size = codec ? codec->decompress (blob->data, blob->size, packed, PACKED_BOUND) : -1;
+  gboolean ok = size >= 0 && rle_decode ((const guchar *) packed, size, dest,
+					 GROMIT_TILE_SIZE, GROMIT_TILE_SIZE);
+  g_free (packed);
+  return ok;
+}
+
+
+/*
+ * Like blob_decode(), for blobs we compressed ourselves.
+ */
+static void blob_unpack (GromitUndoBlob *blob,
+			 gpointer dest)
+{
+  if (!blob_decode (blob, dest))
+    {
+      g_printerr ("Fatal error occurred decompressing image data\n");
+      exit (1);
+    }
+}
+
+
+/*
+ * Set tile 'index' of the backbuffer to the contents of 'blob'.
+ */
+static void decompress_tile (GromitData *data,
+			     guint index,
+			     GromitUndoBlob *blob)
+{
+  if (!blob)
+    {
+      tiled_surface_clear_tile (data->backbuffer, index);
+      return;
+    }
+
+  blob_unpack (blob, tiled_surface_begin_tile_write (data->backbuffer, index));
+  tiled_surface_end_tile_write (data->backbuffer, index);
+
+  /* the tile now is what the blob holds */
+  cache_store (data, index, blob);
+}
+
+
+/*
+ * A new tile surface with the contents of 'blob'.
+ */
+static cairo_surface_t *blob_to_surface (GromitUndoBlob *blob)
+{
+  cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+							 GROMIT_TILE_SIZE, GROMIT_TILE_SIZE);
+  cairo_surface_flush (surface);
+  blob_unpack (blob, cairo_image_surface_get_data (surface));
+  cairo_surface_mark_dirty (surface);
+  return surface;
+}
+
+
+/*
+ * Exchange the tiles of 'entry' with the ones of the backbuffer and
+ * repaint the area they cover.
+ * The tiles coming off the screen are kept uncompressed in the entry, so
+ * swapping it back is only an exchange of pointers. Compressing them is
+ * left to the worker, the blob is needed once the raw tile gets dropped.
+ * Only the entries swapped last keep their raw tiles, see undo_hot.
+ */
+static void undo_entry_swap (GromitData *data,
+			     GromitUndoEntry *entry)
+{
+  GdkRectangle area = { 0, 0, 0, 0 };
+  guint decompressed = 0;
+
+  for (guint i = 0; i < entry->tiles->len; i++)
+    {
+      GromitUndoTile *stored = g_ptr_array_index (entry->tiles, i);
+      GromitUndoBlob *current = tile_blob (data, stored->index, TRUE);
+      cairo_surface_t *incoming = stored->raw;
+
+      if (!incoming && stored->blob)
+	{
+	  incoming = blob_to_surface (stored->blob);
+	  decompressed++;
+	}
+      else if (incoming)
+	entry->n_raw--;
+
+      stored->raw = tiled_surface_swap_tile (data->backbuffer, stored->index, incoming);
+      if (stored->raw)
+	entry->n_raw++;
+
+      /* the tile now is what the blob holds */
+      cache_store (data, stored->index, stored->blob);
+      blob_unref (data, stored->blob);
+      stored->blob = current;
+
+      GdkRectangle rect = {
+	(stored->index % data->backbuffer->cols) * GROMIT_TILE_SIZE,
+	(stored->index / data->backbuffer->cols) * GROMIT_TILE_SIZE,
+	GROMIT_TILE_SIZE, GROMIT_TILE_SIZE
+      };
+      if (area.width == 0)
+	area = rect;
+      else
+	gdk_rectangle_union (&area, &rect, &area);
+    }
+
+  if (area.width > 0)
+    damage_add_rect (data, &area);
+
+  /* most recently swapped first */
+  g_queue_remove (&data->undo_hot, entry);
+  if (entry->n_raw > 0)
+    g_queue_push_head (&data->undo_hot, entry);
+
+  gsize raw_bytes = 0;
+  for (GList *link = data->undo_hot.head; link; )
+    {
+      GromitUndoEntry *hot = link->data;
+      link = link->next;
+      raw_bytes += (gsize) hot->n_raw * GROMIT_TILE_BYTES;
+      if (raw_bytes > undo_raw_budget (data) && hot != entry)
+	entry_drop_raw (data, hot);
+    }
+
+  if(data->debug)
+    g_printerr ("DEBUG: Swapped %u tiles, %u decompressed.\n", entry->tiles->len, decompressed);
+}
+
+
+static void undo_steps_free (GromitData *data,
+			     GQueue *steps)
+{
+  GromitUndoEntry *entry;
+  while ((entry = g_queue_pop_head (steps)))
+    undo_entry_free (data, entry);
+}
+
+
+void undo_init (GromitData *data)
+{
+  g_queue_init (&data->undo_steps);
+  g_queue_init (&data->redo_steps);
+  data->undo_bytes = 0;
+  data->undo_budget = (gsize) GROMIT_DEFAULT_UNDO_MEMORY_MB << 20;
+  data->undo_recording = NULL;
+  data->undo_writer = NULL;
+  data->undo_next_tag = 2;
+  data->undo_codec = codec_default ();
+  g_queue_init (&data->undo_hot);
+  data->undo_cache = NULL;
+  data->undo_cache_version = NULL;
+  data->undo_cache_size = 0;
+
+  g_mutex_init (&data->undo_lock);
+  g_cond_init (&data->undo_cond);
+  data->undo_queued = 0;
+  data->undo_done = 0;
+  data->undo_queue = g_async_queue_new ();
+  data->undo_thread = g_thread_new ("undo", undo_worker, data);
+  data->undo_journal_queue = g_async_queue_new ();
+  data->undo_journal_thread = g_thread_new ("journal", journal_worker, data);
+}
+
+
+/*
+ * Forget all undo and redo steps, e.g. when the tile layout changes.
+ */
+void undo_clear (GromitData *data)
+{
+  undo_wait (data);
+  undo_steps_free (data, &data->undo_steps);
+  undo_steps_free (data, &data->redo_steps);
+  cache_clear (data);
+  undo_journal_schedule (data);
+}
+
+
+static void push_job (GromitData *data,
+		      UndoJob *job)
+{
+  g_mutex_lock (&data->undo_lock);
+  if (job->state)
+    job->after = data->undo_queued;
+  else
+    data->undo_queued++;
+  g_mutex_unlock (&data->undo_lock);
+
+  g_async_queue_push (job->state ? data->undo_journal_queue : data->undo_queue, job);
+}
+
+
+/*
+ * A reference to the blob of tile 'index' of the backbuffer, NULL if it is
+ * empty. Unless the tile did not change since it was last compressed, the
+ * worker compresses a copy of it. 'will_change' tells that the tile is
+ * about to be drawn to, so there is no point in remembering the blob.
+ */
+static GromitUndoBlob *tile_blob (GromitData *data,
+				  guint index,
+				  gboolean will_change)
+{
+  const guchar *raw_data = tiled_surface_get_tile_data (data->backbuffer, index);
+
+  /* empty tiles need no compression */
+  if (!raw_data)
+    return NULL;
+
+  GromitUndoBlob *blob = blob_ref (cache_lookup (data, index));
+  if (blob)
+    return blob;
+
+  blob = blob_new ();
+  if (!will_change)
+    cache_store (data, index, blob);
+
+  UndoJob *job = g_new0 (UndoJob, 1);
+  job->blob = blob_ref (blob);
+  job->raw = g_malloc (GROMIT_TILE_BYTES);
+  memcpy (job->raw, raw_data, GROMIT_TILE_BYTES);
+  job->codec = data->undo_codec;
+  push_job (data, job);
+
+  return blob;
+}
+
+
+/*
+ * Add tile 'index' of the backbuffer to the tiles of 'entry'.
+ */
+static void queue_tile (GromitData *data,
+			GromitUndoEntry *entry,
+			guint index,
+			gboolean will_change)
+{
+  GromitUndoTile *tile = g_new0 (GromitUndoTile, 1);
+  tile->index = index;
+  tile->blob = tile_blob (data, index, will_change);
+  g_ptr_array_add (entry->tiles, tile);
+}
+
+
+void undo_record_tile (GromitData *data,
+		       GromitTiledSurface *ts,
+		       guint index)
+{
+  /* commands are logged instead */
+  if (data->undo_engine == GROMIT_UNDO_COMMANDS)
+    return;
+
+  GromitUndoEntry *entry = data->undo_recording;
+  if (data->undo_per_device)
+    {
+      if (data->undo_writer)
+	entry = data->undo_writer->undo_recording;
+      /* the hook runs again whenever another device takes turns on the tile */
+      for (guint i = 0; entry && i < entry->tiles->len; i++)
+	if (((GromitUndoTile *) g_ptr_array_index (entry->tiles, i))->index == index)
+	  return;
+    }
+
+  if (entry)
+    queue_tile (data, entry, index, TRUE);
+}
+
+
+/*
+ * Attribute the following backbuffer writes to the step 'devdata' is
+ * drawing, or to the global one if it is NULL. Only with UndoPerDevice,
+ * where each step has a writer tag of its own.
+ */
+void undo_set_writer (GromitData *data,
+		      GromitDeviceData *devdata)
+{
+  if (!data->undo_per_device)
+    return;
+
+  GromitUndoEntry *entry = devdata ? devdata->undo_recording : data->undo_recording;
+  data->undo_writer = devdata;
+  tiled_surface_set_writer (data->backbuffer, entry ? entry->tag : 1);
+}
+
+
+/*
+ * Add 'rect' to the area the current stroke of 'devdata' drew on, which
+ * limits what undoing it reverts.
+ */
+void undo_stroke_area (GromitData *data,
+		       GromitDeviceData *devdata,
+		       const GdkRectangle *rect)
+{
+  if (data->undo_per_device && devdata->undo_recording)
+    cairo_region_union_rectangle (devdata->undo_recording->region, rect);
+}
+
+
+/*
+ * With UndoPerDevice, end the step 'devdata' is drawing, or the global
+ * one if it is NULL: remember the tiles as they are now, to tell later
+ * which pixels still show the stroke.
+ */
+void undo_finish_step (GromitData *data,
+		       GromitDeviceData *devdata)
+{
+  if (!data->undo_per_device)
+    return;
+
+  GromitUndoEntry *entry = devdata ? devdata->undo_recording : data->undo_recording;
+  if (!entry)
+    return;
+
+  if (devdata)
+    draw_stroke_end (data, devdata);
+
+  for (guint i = 0; i < entry->tiles->len; i++)
+    {
+      GromitUndoTile *tile = g_ptr_array_index (entry->tiles, i);
+      tile->post = tile_blob (data, tile->index, FALSE);
+    }
+  entry->finished = TRUE;
+
+  if (devdata)
+    devdata->undo_recording = NULL;
+  else
+    data->undo_recording = NULL;
+}
+
+
+/*
+ * 'devdata' goes away, its steps stay as steps of nobody.
+ */
+void undo_forget_device (GromitData *data,
+			 GromitDeviceData *devdata)
+{
+  if (!data->undo_per_device)
+    return;
+
+  undo_finish_step (data, devdata);
+
+  for (GList *link = data->undo_steps.head; link; link = link->next)
+    if (((GromitUndoEntry *) link->data)->owner == devdata)
+      ((GromitUndoEntry *) link->data)->owner = NULL;
+  for (GList *link = data->redo_steps.head; link; link = link->next)
+    if (((GromitUndoEntry *) link->data)->owner == devdata)
+      ((GromitUndoEntry *) link->data)->owner = NULL;
+  if (data->undo_writer == devdata)
+    undo_set_writer (data, NULL);
+}
+
+
+static void log_command (GromitData *data,
+			 GromitUndoCommand *cmd)
+{
+  GromitUndoEntry *entry = data->undo_recording;
+  gsize size = sizeof (GromitUndoCommand) + cmd->n_segments * sizeof (GromitStrokeSegment);
+
+  g_ptr_array_add (entry->commands, cmd);
+
+  /* the worker may be adding keyframe tiles at the same time */
+  g_mutex_lock (&data->undo_lock);
+  entry->bytes += size;
+  data->undo_bytes += size;
+  g_mutex_unlock (&data->undo_lock);
+}
+
+
+static GromitUndoCommand *command_new (GromitUndoCommandType kind,
+				       GromitPaintContext *context)
+{
+  GromitUndoCommand *cmd = g_new0 (GromitUndoCommand, 1);
+  cmd->kind = kind;
+  if (context)
+    {
+      cmd->type = context->type;
+      cmd->color = *context->paint_color;
+    }
+  return cmd;
+}
+
+
+void undo_log_segments (GromitData *data,
+			GromitPaintContext *context,
+			const GromitStrokeSegment *segments,
+			guint n)
+{
+  if (data->undo_engine != GROMIT_UNDO_COMMANDS || !data->undo_recording || n == 0)
+    return;
+
+  GromitUndoCommand *cmd = command_new (GROMIT_UNDO_CMD_SEGMENTS, context);
+  cmd->segments = g_new (GromitStrokeSegment, n);
+  memcpy (cmd->segments, segments, n * sizeof (GromitStrokeSegment));
+  cmd->n_segments = n;
+  log_command (data, cmd);
+}
+
+
+void undo_log_arrow (GromitData *data,
+		     GromitPaintContext *context,
+		     gint x, gint y,
+		     gint width,
+		     gfloat direction)
+{
+  if (data->undo_engine != GROMIT_UNDO_COMMANDS || !data->undo_recording)
+    return;
+
+  GromitUndoCommand *cmd = command_new (GROMIT_UNDO_CMD_ARROW, context);
+  cmd->x = x;
+  cmd->y = y;
+  cmd->width = width;
+  cmd->direction = direction;
+  log_command (data, cmd);
+}
+
+
+void undo_log_clear (GromitData *data)
+{
+  if (data->undo_engine != GROMIT_UNDO_COMMANDS || !data->undo_recording)
+    return;
+
+  log_command (data, command_new (GROMIT_UNDO_CMD_CLEAR, NULL));
+}
+
+
+/*
+ * Forget what the current step drew so far. Used when a stroke is taken
+ * back and drawn again, like SMOOTH does on button release.
+ */
+void undo_log_discard (GromitData *data)
+{
+  GromitUndoEntry *entry = data->undo_recording;
+
+  if (data->undo_engine != GROMIT_UNDO_COMMANDS || !entry)
+    return;
+
+  gsize size = 0;
+  for (guint i = 0; i < entry->commands->len; i++)
+    {
+      GromitUndoCommand *cmd = g_ptr_array_index (entry->commands, i);
+      size += sizeof (GromitUndoCommand) + cmd->n_segments * sizeof (GromitStrokeSegment);
+    }
+  g_ptr_array_set_size (entry->commands, 0);
+
+  g_mutex_lock (&data->undo_lock);
+  entry->bytes -= size;
+  data->undo_bytes -= size;
+  g_mutex_unlock (&data->undo_lock);
+}
+
+
+static void damage_all (GromitData *data)
+{
+  GdkRectangle rect = { 0, 0, data->width, data->height };
+  damage_add_rect (data, &rect);
+}
+
+
+/*
+ * Draw the commands of 'entry' to the backbuffer the way they were drawn
+ * originally, through draw_line() and draw_arrow(). Consecutive commands
+ * in the same color share a context, so that a translucent stroke logged
+ * over several frames is still painted as one, see draw_stroke_end().
+ */
+static guint replay_commands (GromitData *data,
+			      GromitUndoEntry *entry)
+{
+  GromitDeviceData devdata = { 0 };
+  GromitPaintContext *context = NULL;
+  guint maxwidth = data->maxwidth;
+
+  for (guint i = 0; i < entry->commands->len; i++)
+    {
+      GromitUndoCommand *cmd = g_ptr_array_index (entry->commands, i);
+
+      if (context && (cmd->kind != GROMIT_UNDO_CMD_SEGMENTS || cmd->type != context->type ||
+		      !gdk_rgba_equal (&cmd->color, context->paint_color)))
+	{
+	  draw_stroke_end (data, &devdata);
+	  paint_context_free (context);
+	  context = NULL;
+	}
+
+      if (cmd->kind == GROMIT_UNDO_CMD_CLEAR)
+	{
+	  tiled_surface_clear (data->backbuffer);
+	  damage_all (data);
+	  continue;
+	}
+
+      if (!context)
+	context = paint_context_new (data, cmd->type, &cmd->color, 1, 0, GROMIT_ARROW_NONE,
+				     0, 0, 0, 0, 0, 0, 1, 1);
+      devdata.cur_context = context;
+
+      if (cmd->kind == GROMIT_UNDO_CMD_ARROW)
+	draw_arrow (data, &devdata, cmd->x, cmd->y, cmd->width, cmd->direction);
+      else
+	{
+	  for (guint k = 0; k < cmd->n_segments; k++)
+	    {
+	      GromitStrokeSegment *seg = &cmd->segments[k];
+	      data->maxwidth = seg->width;
+	      draw_line (data, &devdata, seg->x1, seg->y1, seg->x2, seg->y2);
+	    }
+	  draw_flush_segments (data, &devdata);
+	}
+    }
+
+  if (context)
+    {
+      draw_stroke_end (data, &devdata);
+      paint_context_free (context);
+    }
+  if (devdata.segments)
+    g_array_free (devdata.segments, TRUE);
+  data->maxwidth = maxwidth;
+
+  return entry->commands->len;
+}
+
+
+/*
+ * Keyframe restore: replace the backbuffer with the stored tiles.
+ */
+static void restore_keyframe (GromitData *data,
+			      GromitUndoEntry *entry)
+{
+  tiled_surface_clear (data->backbuffer);
+  for (guint i = 0; i < entry->tiles->len; i++)
+    {
+      GromitUndoTile *tile = g_ptr_array_index (entry->tiles, i);
+      decompress_tile (data, tile->index, tile->blob);
+    }
+}
+
+
+
+
+/*
+ * Revert the pixels the step of 'entry' changed within its area, as far as
+ * they still show what it drew. Others may have drawn on the same tiles
+ * since, their pixels stay. The stored states are exchanged afterwards, so
+ * the same merge redoes the step.
+ */
+static void undo_entry_merge (GromitData *data,
+			      GromitUndoEntry *entry)
+{
+  guint32 *before = g_malloc (GROMIT_TILE_BYTES);
+  guint32 *after = g_malloc (GROMIT_TILE_BYTES);
+  GdkRectangle area = { 0, 0, 0, 0 };
+
+  for (guint i = 0; i < entry->tiles->len; i++)
+    {
+      GromitUndoTile *tile = g_ptr_array_index (entry->tiles, i);
+      GdkRectangle rect = {
+	(tile->index % data->backbuffer->cols) * GROMIT_TILE_SIZE,
+	(tile->index / data->backbuffer->cols) * GROMIT_TILE_SIZE,
+	GROMIT_TILE_SIZE, GROMIT_TILE_SIZE
+      };
+      cairo_region_t *part = entry->region ? cairo_region_copy (entry->region)
+					   : cairo_region_create_rectangle (&rect);
+      cairo_region_intersect_rectangle (part, &rect);
+
+      if ((tile->blob || tile->post) && !cairo_region_is_empty (part))
+	{
+	  blob_unpack (tile->blob, before);
+	  blob_unpack (tile->post, after);
+
+	  guint32 *pixels = (guint32 *) tiled_surface_begin_tile_write (data->backbuffer, tile->index);
+	  for (gint k = 0; k < cairo_region_num_rectangles (part); k++)
+	    {
+	      GdkRectangle r;
+	      cairo_region_get_rectangle (part, k, &r);
+	      for (gint y = r.y - rect.y; y < r.y - rect.y + r.height; y++)
+		for (gint x = r.x - rect.x; x < r.x - rect.x + r.width; x++)
+		  {
+		    guint offset = y * GROMIT_TILE_SIZE + x;
+		    if (pixels[offset] == after[offset])
+		      pixels[offset] = before[offset];
+		  }
+	    }
+	  tiled_surface_end_tile_write (data->backbuffer, tile->index);
+
+	  if (area.width == 0)
+	    area = rect;
+	  else
+	    gdk_rectangle_union (&area, &rect, &area);
+	}
+      cairo_region_destroy (part);
+
+      GromitUndoBlob *blob = tile->blob;
+      tile->blob = tile->post;
+      tile->post = blob;
+    }
+
+  g_free (before);
+  g_free (after);
+
+  if (area.width > 0)
+    damage_add_rect (data, &area);
+}
+
+
+/*
+ * Whether undo or redo of 'devdata' applies to 'entry', NULL meaning any
+ * device. Steps still being drawn are left alone.
+ */
+static gboolean step_matches (GromitUndoEntry *entry,
+			      GromitDeviceData *devdata)
+{
+  return entry->finished && (!devdata || entry->owner == devdata);
+}
+
+
+/*
+ * Start a new undo step. Tiles are added to it as they get drawn to.
+ * With UndoPerDevice the step belongs to 'devdata', or to nobody if it is
+ * NULL, and has to be ended with undo_finish_step().
+ */
+void snap_undo_state (GromitData *data,
+		      GromitDeviceData *devdata)
+{
+  draw_flush_all(data);
+
+  if (data->undo_per_device)
+    {
+      // A stroke may have ended without a release
+      undo_finish_step (data, devdata);
+
+      // Invalidate the redo of this device, the others still apply
+      for (GList *link = data->redo_steps.head; link; )
+	{
+	  GList *next = link->next;
+	  if (!devdata || ((GromitUndoEntry *) link->data)->owner == devdata)
+	    {
+	      undo_entry_free (data, link->data);
+	      g_queue_delete_link (&data->redo_steps, link);
+	    }
+	  link = next;
+	}
+    }
+  else
+    // Invalidate any redo from this position
+    undo_steps_free (data, &data->redo_steps);
+
+  // Drop the oldest steps if we ran out of memory. Command steps are only
+  // useful together with the keyframe before them, so these go up to the
+  // next keyframe. The worker may still be adding to undo_bytes, the
+  // blobs it works on stay alive until it is done with them.
+  guint evicted = 0;
+  gsize bytes;
+  for (;;)
+    {
+      g_mutex_lock (&data->undo_lock);
+      bytes = data->undo_bytes;
+      g_mutex_unlock (&data->undo_lock);
+      if (bytes <= data->undo_budget - undo_raw_budget (data)
+	  || g_queue_is_empty (&data->undo_steps))
+	break;
+
+      if (data->undo_engine == GROMIT_UNDO_COMMANDS)
+	{
+	  GList *next = g_queue_peek_head_link (&data->undo_steps)->next;
+	  while (next && !((GromitUndoEntry *) next->data)->tiles)
+	    next = next->next;
+	  if (!next)
+	    break;
+	  while (g_queue_peek_head_link (&data->undo_steps) != next)
+	    {
+	      undo_entry_free (data, g_queue_pop_head (&data->undo_steps));
+	      evicted++;
+	    }
+	  continue;
+	}
+      undo_entry_free (data, g_queue_pop_head (&data->undo_steps));
+      evicted++;
+    }
+
+  if(data->debug)
+    g_printerr ("DEBUG: Snapping undo step %u, %u tiles (%" G_GSIZE_FORMAT " bytes) on screen, "
+		"%" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " bytes in undo buffers, %u steps dropped.\n",
+		g_queue_get_length (&data->undo_steps), data->backbuffer->n_allocated,
+		tiled_surface_get_bytes(data->backbuffer),
+		bytes, data->undo_budget, evicted);
+
+  GromitUndoEntry *entry = g_new0 (GromitUndoEntry, 1);
+
+  if (data->undo_engine == GROMIT_UNDO_COMMANDS)
+    {
+      // Keyframe if the last one is undo_keyframe_interval steps back
+      guint since_keyframe = 0;
+      GList *link = g_queue_peek_tail_link (&data->undo_steps);
+      while (link && !((GromitUndoEntry *) link->data)->tiles)
+	{
+	  since_keyframe++;
+	  link = link->prev;
+	}
+
+      entry->commands = g_ptr_array_new_with_free_func (undo_command_free);
+      if (!link || since_keyframe + 1 >= data->undo_keyframe_interval)
+	{
+	  entry->tiles = g_ptr_array_new ();
+	  for (guint i = 0; i < tiled_surface_n_tiles (data->backbuffer); i++)
+	    if (tiled_surface_get_tile_data (data->backbuffer, i))
+	      queue_tile (data, entry, i, FALSE);
+	}
+    }
+  else
+    entry->tiles = g_ptr_array_new ();
+
+  g_queue_push_tail (&data->undo_steps, entry);
+
+  if (data->undo_per_device)
+    {
+      // Tags 0 and 1 are taken by the tiled surface
+      if (data->undo_next_tag < 2)
+	data->undo_next_tag = 2;
+      entry->tag = data->undo_next_tag++;
+      entry->owner = devdata;
+      if (devdata)
+	{
+	  entry->region = cairo_region_create ();
+	  devdata->undo_recording = entry;
+	}
+      else
+	data->undo_recording = entry;
+      undo_set_writer (data, NULL);
+    }
+  else
+    {
+      data->undo_recording = entry;
+      tiled_surface_reset_written (data->backbuffer);
+    }
+
+  undo_journal_schedule (data);
+}
+
+
+/*
+ * Undo the last step, with UndoPerDevice the last one of 'devdata' if it
+ * is not NULL.
+ */
+void undo_drawing (GromitData *data,
+		   GromitDeviceData *devdata)
+{
+  if(g_queue_is_empty (&data->undo_steps))
+    return;
+  draw_flush_all(data);
+  undo_wait(data);
+
+  if (data->undo_per_device)
+    {
+      GList *link = g_queue_peek_tail_link (&data->undo_steps);
+      while (link && !step_matches (link->data, devdata))
+	link = link->prev;
+      if (!link)
+	return;
+
+      GromitUndoEntry *entry = link->data;
+      g_queue_delete_link (&data->undo_steps, link);
+      undo_entry_merge (data, entry);
+      g_queue_push_head (&data->redo_steps, entry);
+
+      data->modified = 1;
+      undo_journal_schedule (data);
+
+      if(data->debug)
+	g_printerr ("DEBUG: Undo drawing of device %p, %u tiles.\n",
+		    (void *) devdata, entry->tiles->len);
+      return;
+    }
+
+  data->undo_recording = NULL;
+
+  if (data->undo_engine == GROMIT_UNDO_COMMANDS)
+    {
+      // Find the keyframe at or before the undone step and replay up to it
+      GList *undone = g_queue_peek_tail_link (&data->undo_steps);
+      GList *link = undone;
+      gint64 start = g_get_monotonic_time ();
+      guint replayed = 0;
+
+      while (link->prev && !((GromitUndoEntry *) link->data)->tiles)
+	link = link->prev;
+
+      if (((GromitUndoEntry *) link->data)->tiles)
+	restore_keyframe (data, link->data);
+      else
+	tiled_surface_clear (data->backbuffer);
+
+      for (; link != undone; link = link->next)
+	replayed += replay_commands (data, link->data);
+
+      damage_all (data);
+
+      if(data->debug)
+	g_printerr ("DEBUG: Undo replayed %u commands in %" G_GINT64_FORMAT " us.\n",
+		    replayed, g_get_monotonic_time () - start);
+    }
+
+  GromitUndoEntry *entry = g_queue_pop_tail (&data->undo_steps);
+  if (data->undo_engine != GROMIT_UNDO_COMMANDS)
+    undo_entry_swap (data, entry);
+  g_queue_push_head (&data->redo_steps, entry);
+
+  data->modified = 1;
+  undo_journal_schedule (data);
+
+  if(data->debug)
+    g_printerr ("DEBUG: Undo drawing %u.\n", g_queue_get_length (&data->undo_steps));
+}
+
+
+/*
+ * Redo the last undone step, with UndoPerDevice the one of 'devdata' if it
+ * is not NULL.
+ */
+void redo_drawing (GromitData *data,
+		   GromitDeviceData *devdata)
+{
+  if(g_queue_is_empty (&data->redo_steps))
+    return;
+  draw_flush_all(data);
+  undo_wait(data);
+
+  if (data->undo_per_device)
+    {
+      GList *link = g_queue_peek_head_link (&data->redo_steps);
+      while (link && !step_matches (link->data, devdata))
+	link = link->next;
+      if (!link)
+	return;
+
+      GromitUndoEntry *entry = link->data;
+      g_queue_delete_link (&data->redo_steps, link);
+      undo_entry_merge (data, entry);
+      g_queue_push_tail (&data->undo_steps, entry);
+
+      data->modified = 1;
+      undo_journal_schedule (data);
+
+      if(data->debug)
+	g_printerr ("DEBUG: Redo drawing of device %p.\n", (void *) devdata);
+      return;
+    }
+
+  data->undo_recording = NULL;
+
+  GromitUndoEntry *entry = g_queue_pop_head (&data->redo_steps);
+  if (data->undo_engine == GROMIT_UNDO_COMMANDS)
+    replay_commands (data, entry);
+  else
+    undo_entry_swap (data, entry);
+  g_queue_push_tail (&data->undo_steps, entry);
+
+  data->modified = 1;
+  undo_journal_schedule (data);
+
+  if(data->debug)
+    g_printerr("DEBUG: Redo drawing.\n");
+}
+
+
+/*
+ * Journal.
+ * A state record lists the tiles of the screen and of each undo and redo
+ * step as pairs of tile index and blob id, blob id 0 being an empty tile:
+ *   width, height, n_canvas, n_undo, n_redo, n_canvas pairs,
+ *   then per step its number of pairs followed by the pairs.
+ * The blobs are written as records of their own, each only once.
+ */
+
+static void state_add_tile (GromitUndoTile *tile,
+			    GArray *state,
+			    GPtrArray *blobs)
+{
+  guint32 pair[2] = { tile->index, 0 };
+  if (tile->blob)
+    {
+      g_ptr_array_add (blobs, blob_ref (tile->blob));
+      /* the worker replaces the slot by the id */
+      pair[1] = blobs->len;
+    }
+  g_array_append_vals (state, pair, 2);
+}
+
+
+static void state_add_steps (GQueue *steps,
+			     GArray *state,
+			     GPtrArray *blobs)
+{
+  for (GList *link = steps->head; link; link = link->next)
+    {
+      GromitUndoEntry *entry = link->data;
+      guint32 n = entry->tiles->len;
+      g_array_append_val (state, n);
+      for (guint i = 0; i < n; i++)
+	state_add_tile (g_ptr_array_index (entry->tiles, i), state, blobs);
+    }
+}
+
+
+/*
+ * Snapshot of the screen and the undo steps for the worker to write out.
+ */
+static UndoJob *journal_build_state (GromitData *data)
+{
+  UndoJob *job = g_new0 (UndoJob, 1);
+  GArray *state = g_array_new (FALSE, FALSE, sizeof (guint32));
+  GPtrArray *blobs = g_ptr_array_new ();
+
+  /* command and per device steps are not journaled, only the screen */
+  gboolean steps = data->undo_engine == GROMIT_UNDO_TILES && !data->undo_per_device;
+  guint32 header[5] = { data->width, data->height, 0,
+			steps ? g_queue_get_length (&data->undo_steps) : 0,
+			steps ? g_queue_get_length (&data->redo_steps) : 0 };
+  g_array_append_vals (state, header, 5);
+
+  for (guint i = 0; i < tiled_surface_n_tiles (data->backbuffer); i++)
+    {
+      GromitUndoTile tile = { i, tile_blob (data, i, FALSE), NULL, NULL };
+      if (!tile.blob)
+	continue;
+      state_add_tile (&tile, state, blobs);
+      blob_unref (data, tile.blob);
+      g_array_index (state, guint32, 2)++;
+    }
+
+  if (steps)
+    {
+      state_add_steps (&data->undo_steps, state, blobs);
+      state_add_steps (&data->redo_steps, state, blobs);
+    }
+
+  job->state = state;
+  job->state_blobs = blobs;
+  return job;
+}
+
+
+static gboolean on_journal_timeout (gpointer user_data)
+{
+  GromitData *data = (GromitData *) user_data;
+
+  data->undo_journal_timeout = 0;
+  draw_flush_all (data);
+  push_job (data, journal_build_state (data));
+
+  return G_SOURCE_REMOVE;
+}
+
+
+/*
+ * Write the state out soon, changes in between are batched up.
+ */
+void undo_journal_schedule (GromitData *data)
+{
+  if (!data->undo_journal_path || data->undo_journal_timeout)
+    return;
+
+  data->undo_journal_timeout = g_timeout_add (JOURNAL_DELAY_MS, on_journal_timeout, data);
+}
+
+
+static gboolean journal_write_blob (GromitJournal *j,
+				    GromitUndoBlob *blob,
+				    guint32 id)
+{
+  guchar *payload = journal_reserve (j, 3 * sizeof (guint32) + blob->size);
+  if (!payload)
+    return FALSE;
+
+  guint32 header[3] = { id, blob->size, blob->codec };
+  memcpy (payload, header, sizeof (header));
+  memcpy (payload + sizeof (header), blob->data, blob->size);
+  journal_commit (j, JOURNAL_BLOB);
+  return TRUE;
+}
+
+
+/*
+ * Runs on the journal thread, after the blobs of the state are filled in.
+ * Appends the blobs not yet in the journal and the state. Once the journal
+ * holds mostly outdated records, a new one is started with only what this
+ * state uses and moved over the old one.
+ */
+static void journal_write_state (GromitData *data,
+				 UndoJob *job)
+{
+  GPtrArray *blobs = job->state_blobs;
+  GArray *state = job->state;
+  gsize live = state->len * sizeof (guint32);
+
+  for (guint i = 0; i < blobs->len; i++)
+    live += ((GromitUndoBlob *) g_ptr_array_index (blobs, i))->size;
+
+  GromitJournal *j = data->undo_journal;
+  if (!j || journal_size (j) > 4 * live + (1 << 20))
+    {
+      gchar *tmp_path = g_strconcat (data->undo_journal_path, ".new", NULL);
+      j = journal_create (tmp_path);
+      g_free (tmp_path);
+      /* blobs written to the old journal have to go to the new one, too */
+      data->undo_journal_gen++;
+      data->undo_journal_next_id = 1;
+    }
+
+  gboolean ok = j != NULL;
+  for (guint i = 0; ok && i < blobs->len; i++)
+    {
+      GromitUndoBlob *blob = g_ptr_array_index (blobs, i);
+      if (blob->journal_gen == data->undo_journal_gen)
+	continue;
+      ok = journal_write_blob (j, blob, data->undo_journal_next_id);
+      blob->journal_id = data->undo_journal_next_id++;
+      blob->journal_gen = data->undo_journal_gen;
+    }
+
+  guint32 *words = ok ? (guint32 *) journal_reserve (j, state->len * sizeof (guint32)) : NULL;
+  if (words)
+    {
+      memcpy (words, state->data, state->len * sizeof (guint32));
+
+      /* blob slots to ids */
+      guint pos = 5;
+      guint n_steps = words[3] + words[4];
+      for (gint step = -1; step < (gint) n_steps; step++)
+	{
+	  guint32 n = step < 0 ? words[2] : words[pos++];
+	  for (guint k = 0; k < n; k++, pos += 2)
+	    if (words[pos + 1])
+	      words[pos + 1] = ((GromitUndoBlob *) g_ptr_array_index (blobs, words[pos + 1] - 1))->journal_id;
+	}
+      journal_commit (j, JOURNAL_STATE);
+    }
+
+  if (!words)
+    {
+      /* start over with a new journal next time, the old file keeps its last state */
+      if (j != data->undo_journal)
+	journal_close (j);
+      journal_close (data->undo_journal);
+      data->undo_journal = NULL;
+      data->undo_journal_gen++;
+    }
+  else if (j != data->undo_journal)
+    {
+      if (journal_rename (j, data->undo_journal_path))
+	{
+	  journal_close (data->undo_journal);
+	  data->undo_journal = j;
+	}
+      else
+	{
+	  journal_close (j);
+	  data->undo_journal_gen++;
+	}
+    }
+
+  for (guint i = 0; i < blobs->len; i++)
+    blob_unref (data, g_ptr_array_index (blobs, i));
+  g_ptr_array_free (blobs, TRUE);
+  g_array_free (state, TRUE);
+}
+
+
+/*
+ * Reference to the blob with 'id', read from the journal on first use.
+ */
+/*
+ * Look up blob 'id' of the journal, a new reference or NULL for an empty
+ * tile in 'blob'. Returns FALSE if the record is there but does not decode,
+ * e.g. because it was torn by a crash.
+ */
+static gboolean journal_get_blob (GromitData *data,
+				  GHashTable *records,
+				  GHashTable *blobs,
+				  guint32 id,
+				  GromitUndoBlob **blob)
+{
+  *blob = g_hash_table_lookup (blobs, GUINT_TO_POINTER (id));
+  if (*blob)
+    {
+      blob_ref (*blob);
+      return TRUE;
+    }
+
+  const guint32 *record = g_hash_table_lookup (records, GUINT_TO_POINTER (id));
+  if (!record)
+    return TRUE;
+
+  GromitUndoBlob *restored = blob_new ();
+  restored->size = record[1];
+  restored->codec = record[2];
+  restored->data = g_memdup (record + 3, record[1]);
+
+  gpointer scratch = g_malloc (GROMIT_TILE_BYTES);
+  gboolean ok = blob_decode (restored, scratch);
+  g_free (scratch);
+  if (!ok)
+    {
+      /* not counted in undo_bytes yet */
+      restored->size = 0;
+      blob_unref (data, restored);
+      return FALSE;
+    }
+
+  data->undo_bytes += restored->size;
+  g_hash_table_insert (blobs, GUINT_TO_POINTER (id), restored);
+  *blob = blob_ref (restored);
+  return TRUE;
+}
+
+
+/*
+ * An undo step of the journal, NULL if one of its blobs does not decode.
+ */
+static GromitUndoEntry *journal_read_step (GromitData *data,
+					   const guint32 *words,
+					   guint n,
+					   GHashTable *records,
+					   GHashTable *blobs)
+{
+  GromitUndoEntry *entry = g_new0 (GromitUndoEntry, 1);
+  entry->tiles = g_ptr_array_new ();
+
+  for (guint k = 0; k < n; k++)
+    {
+      GromitUndoTile *tile = g_new0 (GromitUndoTile, 1);
+      tile->index = words[2 * k];
+      g_ptr_array_add (entry->tiles, tile);
+      if (words[2 * k + 1] &&
+	  !journal_get_blob (data, records, blobs, words[2 * k + 1], &tile->blob))
+	{
+	  undo_entry_free (data, entry);
+	  return NULL;
+	}
+    }
+
+  return entry;
+}
+
+
+/*
+ * Check that the state record of 'length' bytes is consistent, so that
+ * restoring it cannot read out of bounds.
+ */
+static gboolean journal_check_state (GromitData *data,
+				     const guint32 *words,
+				     guint32 length)
+{
+  guint n_words = length / sizeof (guint32);
+  guint n_tiles = tiled_surface_n_tiles (data->backbuffer);
+
+  if (n_words < 5 || words[0] != data->width || words[1] != data->height)
+    return FALSE;
+
+  guint pos = 5;
+  guint n_steps = words[3] + words[4];
+  for (gint step = -1; step < (gint) n_steps; step++)
+    {
+      if (step >= 0 && pos >= n_words)
+	return FALSE;
+      guint32 n = step < 0 ? words[2] : words[pos++];
+      if (n > (n_words - pos) / 2)
+	return FALSE;
+      for (guint k = 0; k < n; k++, pos += 2)
+	if (words[pos] >= n_tiles)
+	  return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+/*
+ * Bring back the screen and undo steps from the journal of a previous run
+ * and keep journaling from now on.
+ */
+void undo_journal_restore (GromitData *data)
+{
+  /* one journal per display, instances on different displays must not share it */
+  gchar *display = g_strdup (gdk_display_get_name (data->display));
+  g_strdelimit (display, "/", '_');
+  gchar *name = g_strdup_printf ("gromit-mpx-%s.journal", display);
+  data->undo_journal_path = g_build_filename (g_get_user_runtime_dir (), name, NULL);
+  g_free (name);
+  g_free (display);
+
+  GromitJournal *j = journal_open (data->undo_journal_path);
+  if (!j)
+    {
+      undo_journal_schedule (data);
+      return;
+    }
+
+  GHashTable *records = g_hash_table_new (NULL, NULL);
+  const guint32 *state = NULL;
+  guint32 state_length = 0;
+  gsize offset = 0;
+  guint32 type, length;
+  const guchar *payload;
+
+  while (journal_next (j, &offset, &type, &payload, &length))
+    {
+      const guint32 *words = (const guint32 *) payload;
+      /* blobs of codecs missing in this build read as empty tiles */
+      if (type == JOURNAL_BLOB && length >= 12 && words[1] <= length - 12 && codec_by_id (words[2]))
+	g_hash_table_insert (records, GUINT_TO_POINTER (words[0]), (gpointer) words);
+      else if (type == JOURNAL_STATE)
+	{
+	  state = words;
+	  state_length = length;
+	}
+    }
+
+  if (state && journal_check_state (data, state, state_length))
+    {
+      GHashTable *blobs = g_hash_table_new (NULL, NULL);
+      const guint32 *words = state + 5;
+
+      gboolean steps = TRUE;
+      for (guint k = 0; k < state[2]; k++, words += 2)
+	{
+	  GromitUndoBlob *blob;
+	  if (!journal_get_blob (data, records, blobs, words[1], &blob))
+	    {
+	      g_printerr ("Not restoring journal %s, its screen is damaged.\n",
+			  data->undo_journal_path);
+	      tiled_surface_clear (data->backbuffer);
+	      steps = FALSE;
+	      break;
+	    }
+	  decompress_tile (data, words[0], blob);
+	  blob_unref (data, blob);
+	}
+
+      /* tile steps make no sense to the command engine, and lack the owner for per device undo */
+      if (data->undo_engine != GROMIT_UNDO_TILES || data->undo_per_device)
+	steps = FALSE;
+      gboolean redo = TRUE;
+      for (guint step = 0; steps && step < state[3] + state[4]; step++)
+	{
+	  guint32 n = *words++;
+	  GromitUndoEntry *entry = journal_read_step (data, words, n, records, blobs);
+	  words += 2 * n;
+
+	  /*
+	    A damaged step cuts the chain of steps: the undo steps before it
+	    and the redo steps after it cannot be reached anymore.
+	  */
+	  if (!entry)
+	    {
+	      g_printerr ("Dropping a damaged %s step from journal %s.\n",
+			  step < state[3] ? "undo" : "redo", data->undo_journal_path);
+	      if (step < state[3])
+		undo_steps_free (data, &data->undo_steps);
+	      else
+		redo = FALSE;
+	      continue;
+	    }
+	  if (step < state[3])
+	    g_queue_push_tail (&data->undo_steps, entry);
+	  else if (redo)
+	    g_queue_push_tail (&data->redo_steps, entry);
+	  else
+	    undo_entry_free (data, entry);
+	}
+
+      /* drop the lookup references */
+      GHashTableIter it;
+      gpointer blob;
+      g_hash_table_iter_init (&it, blobs);
+      while (g_hash_table_iter_next (&it, NULL, &blob))
+	blob_unref (data, blob);
+      g_hash_table_destroy (blobs);
+
+      GdkRectangle rect = { 0, 0, data->width, data->height };
+      damage_add_rect (data, &rect);
+      data->modified = 1;
+
+      if(data->debug)
+	g_printerr ("DEBUG: Restored %u tiles and %u undo steps from %s.\n",
+		    state[2], state[3], data->undo_journal_path);
+    }
+  else if (state)
+    g_printerr ("Not restoring journal %s, it is for a different screen size.\n",
+		data->undo_journal_path);
+
+  g_hash_table_destroy (records);
+  journal_close (j);
+
+  /* start a fresh journal with what was restored */
+  undo_journal_schedule (data);
+}
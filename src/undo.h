@@ -0,0 +1,137 @@
+#ifndef UNDO_H
+#define UNDO_H
+
+/*
+  Undo/redo, with one of two engines selected by data->undo_engine.
+  GROMIT_UNDO_TILES: an undo entry holds the tiles of the backbuffer that a
+  stroke changed, as they were before the stroke. They are captured by the
+  backbuffer's write hook right before the stroke first touches them.
+  Undoing or redoing swaps the stored tiles with the ones on screen, so the
+  same entry holds the other state afterwards.
+  GROMIT_UNDO_COMMANDS: an undo entry holds the drawing commands of a
+  stroke, and every data->undo_keyframe_interval steps a keyframe of all
+  tiles as they were before it. Undoing restores the nearest keyframe and
+  replays the steps after it, redoing replays the step on top.
+  The compressed size of all entries together with the uncompressed tiles
+  kept for fast swapping is kept below data->undo_budget by dropping the
+  oldest undo steps when a new one is started.
+  Tiles are only copied while drawing, compressing them is left to a worker
+  thread so that drawing does not wait for it. Undo, redo and clearing need
+  the blobs filled in and call undo_wait() first, starting a step does not
+  wait.
+  Compressed tiles are immutable and reference counted. The last blob of
+  each backbuffer tile is remembered together with the tile's version, so
+  a tile that did not change since is shared instead of compressed again.
+  Optionally, the screen and undo steps are also written to a journal in
+  the runtime directory, so that they survive a crash or restart.
+  With UndoPerDevice (tiles engine only) each device draws its own steps:
+  the write hook runs again when another device touches a tile, and a
+  step also keeps its tiles as they were after the stroke. Undoing then
+  only reverts the pixels of the stroke's area that still show the stroke,
+  leaving what other users drew since.
+*/
+
+#include "main.h"
+#include "drawing.h"
+
+typedef struct _GromitUndoBlob
+{
+  gint     ref_count;
+  /* compressed tile, filled in by the worker, see compress_raw() */
+  guint32  size;
+  gchar   *data;
+  /* GromitCodecId of 'data' */
+  guint8   codec;
+  /* where the worker wrote it to the journal, see undo_journal_restore() */
+  guint32  journal_id;
+  guint32  journal_gen;
+} GromitUndoBlob;
+
+typedef struct
+{
+  guint32  index;
+  /* NULL for an empty tile */
+  GromitUndoBlob *blob;
+  /* the same uncompressed, if kept, see undo_entry_swap() */
+  cairo_surface_t *raw;
+  /* UndoPerDevice: the other state, see undo_finish_step() */
+  GromitUndoBlob *post;
+} GromitUndoTile;
+
+/* share of data->undo_budget for uncompressed tiles kept around for fast
+   undo and redo, see undo_raw_budget() */
+#define GROMIT_UNDO_RAW_SHARE 4
+
+typedef enum
+{
+  GROMIT_UNDO_CMD_SEGMENTS,
+  GROMIT_UNDO_CMD_ARROW,
+  GROMIT_UNDO_CMD_CLEAR
+} GromitUndoCommandType;
+
+typedef struct
+{
+  GromitUndoCommandType kind;
+  /* the tool decides the operator and how segments are rasterized */
+  GromitPaintType type;
+  GdkRGBA         color;
+  /* GROMIT_UNDO_CMD_SEGMENTS */
+  GromitStrokeSegment *segments;
+  guint           n_segments;
+  /* GROMIT_UNDO_CMD_ARROW, as passed to draw_arrow() */
+  gint            x, y, width;
+  gfloat          direction;
+} GromitUndoCommand;
+
+typedef struct _GromitUndoEntry
+{
+  /* GromitUndoTile pointers, stable while the worker fills them in.
+     The keyframe with GROMIT_UNDO_COMMANDS, NULL if the step has none. */
+  GPtrArray *tiles;
+  /* GromitUndoCommand pointers, GROMIT_UNDO_COMMANDS only */
+  GPtrArray *commands;
+  /* size of the commands, blobs are accounted for on their own */
+  gsize    bytes;
+  /* number of tiles with a raw copy */
+  guint    n_raw;
+  /* UndoPerDevice: the device drawing it, NULL for global steps like
+     clearing the screen, its writer tag and the area its stroke covers */
+  GromitDeviceData *owner;
+  guint32  tag;
+  cairo_region_t *region;
+  /* the tiles' state after the step is known */
+  gboolean finished;
+} GromitUndoEntry;
+
+
+void undo_init (GromitData *data);
+void undo_clear (GromitData *data);
+void undo_wait (GromitData *data);
+
+/* called from the backbuffer's write hook */
+void undo_record_tile (GromitData *data, GromitTiledSurface *ts, guint index);
+
+/* UndoPerDevice bookkeeping, these do nothing otherwise */
+void undo_set_writer (GromitData *data, GromitDeviceData *devdata);
+void undo_stroke_area (GromitData *data, GromitDeviceData *devdata, const GdkRectangle *rect);
+void undo_finish_step (GromitData *data, GromitDeviceData *devdata);
+void undo_forget_device (GromitData *data, GromitDeviceData *devdata);
+
+/* command log of the current step, these do nothing with GROMIT_UNDO_TILES */
+void undo_log_segments (GromitData *data, GromitPaintContext *context,
+			const GromitStrokeSegment *segments, guint n);
+void undo_log_arrow (GromitData *data, GromitPaintContext *context,
+		     gint x, gint y, gint width, gfloat direction);
+void undo_log_clear (GromitData *data);
+void undo_log_discard (GromitData *data);
+
+/* read the journal of the last run and keep writing it */
+void undo_journal_restore (GromitData *data);
+void undo_journal_schedule (GromitData *data);
+
+/* 'devdata' only matters with UndoPerDevice, NULL stands for all devices */
+void snap_undo_state (GromitData *data, GromitDeviceData *devdata);
+void undo_drawing (GromitData *data, GromitDeviceData *devdata);
+void redo_drawing (GromitData *data, GromitDeviceData *devdata);
+
+#endif
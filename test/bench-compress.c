@@ -0,0 +1,168 @@
+/*
+  Compares compressing undo tiles with plain LZ4 against the transparency
+  run-length pre-pass of src/rle.c followed by each codec of src/codec.c,
+  like compress_raw() in undo.c does. Frames are PNG screenshots of the
+  drawing layer given on the command line, or generated strokes on a
+  transparent frame if there are none. Empty tiles are skipped, undo does
+  not compress these either.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <cairo.h>
+#include <lz4.h>
+#include "rle.h"
+#include "codec.h"
+
+#define TILE 256
+#define TILE_BYTES (TILE * TILE * 4)
+#define ROUNDS 20
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a few antialiased freehand strokes, roughly what an annotation looks like */
+static cairo_surface_t *make_frame(int seed)
+{
+    cairo_surface_t *s = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1920, 1080);
+    cairo_t *cr = cairo_create(s);
+
+    srand(seed);
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+    for (int stroke = 0; stroke < 12; stroke++) {
+        double x = rand() % 1920, y = rand() % 1080, angle = 0;
+        cairo_set_source_rgba(cr, rand() % 2, rand() % 2, rand() % 2, 1);
+        cairo_set_line_width(cr, 2 + rand() % 10);
+        cairo_move_to(cr, x, y);
+        for (int i = 0; i < 300; i++) {
+            angle += (rand() / (double) RAND_MAX - 0.5) * 0.5;
+            x += 4 * cos(angle);
+            y += 4 * sin(angle);
+            cairo_line_to(cr, x, y);
+        }
+        cairo_stroke(cr);
+    }
+    cairo_destroy(cr);
+    return s;
+}
+
+/* append the non-empty tiles of 's' to 'tiles', returns the new count */
+static int add_tiles(cairo_surface_t *s, unsigned char **tiles, int n, int max)
+{
+    int width = cairo_image_surface_get_width(s);
+    int height = cairo_image_surface_get_height(s);
+    int stride = cairo_image_surface_get_stride(s);
+    unsigned char *data = cairo_image_surface_get_data(s);
+
+    cairo_surface_flush(s);
+    for (int ty = 0; ty < height; ty += TILE)
+        for (int tx = 0; tx < width && n < max; tx += TILE) {
+            unsigned char *tile = calloc(1, TILE_BYTES);
+            int empty = 1;
+            for (int y = 0; y < TILE && ty + y < height; y++) {
+                int w = tx + TILE <= width ? TILE : width - tx;
+                memcpy(tile + y * TILE * 4, data + (ty + y) * stride + tx * 4, w * 4);
+            }
+            for (int i = 0; i < TILE_BYTES && empty; i++)
+                empty = tile[i] == 0;
+            if (empty)
+                free(tile);
+            else
+                tiles[n++] = tile;
+        }
+    return n;
+}
+
+/* plain LZ4 without the pre-pass if 'codec' is NULL */
+static void run(const GromitCodec *codec, unsigned char **tiles, int n)
+{
+    const char *name = codec ? codec->name : "plain lz4";
+    int bound = codec ? (int) codec->bound(RLE_BOUND(TILE, TILE)) : LZ4_compressBound(TILE_BYTES);
+    char *packed = malloc(RLE_BOUND(TILE, TILE));
+    char **out = malloc(n * sizeof(char *));
+    int *sizes = malloc(n * sizeof(int));
+    unsigned char *back = malloc(TILE_BYTES);
+    double total = 0, t_comp = 0, t_decomp = 0;
+
+    for (int i = 0; i < n; i++)
+        out[i] = malloc(bound);
+
+    for (int r = 0; r < ROUNDS; r++) {
+        double t0 = now();
+        for (int i = 0; i < n; i++) {
+            if (codec) {
+                int len = rle_encode((const guint32 *) tiles[i], TILE, TILE, (guchar *) packed);
+                sizes[i] = codec->compress(packed, len, out[i], bound);
+            } else
+                sizes[i] = LZ4_compress_default((const char *) tiles[i], out[i], TILE_BYTES, bound);
+        }
+        double t1 = now();
+        for (int i = 0; i < n; i++) {
+            if (codec) {
+                int len = codec->decompress(out[i], sizes[i], packed, RLE_BOUND(TILE, TILE));
+                rle_decode((const guchar *) packed, len, (guint32 *) back, TILE, TILE);
+            } else
+                LZ4_decompress_safe(out[i], (char *) back, sizes[i], TILE_BYTES);
+            if (r == 0 && memcmp(back, tiles[i], TILE_BYTES) != 0) {
+                fprintf(stderr, "%s: tile %d does not round-trip\n", name, i);
+                exit(1);
+            }
+        }
+        t_comp += t1 - t0;
+        t_decomp += now() - t1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        total += sizes[i];
+        free(out[i]);
+    }
+    double mb = (double) n * TILE_BYTES * ROUNDS / (1 << 20);
+    printf("%-10s  ratio %6.1f:1  compress %7.0f MB/s  decompress %7.0f MB/s\n",
+           name, (double) n * TILE_BYTES / total, mb / t_comp, mb / t_decomp);
+
+    free(out);
+    free(sizes);
+    free(back);
+    free(packed);
+}
+
+int main(int argc, char **argv)
+{
+    int max = 4096, n = 0;
+    unsigned char **tiles = malloc(max * sizeof(unsigned char *));
+
+    if (argc > 1)
+        for (int i = 1; i < argc; i++) {
+            cairo_surface_t *s = cairo_image_surface_create_from_png(argv[i]);
+            if (cairo_surface_status(s) != CAIRO_STATUS_SUCCESS) {
+                fprintf(stderr, "Could not read %s\n", argv[i]);
+                return 1;
+            }
+            n = add_tiles(s, tiles, n, max);
+            cairo_surface_destroy(s);
+        }
+    else
+        for (int i = 0; i < 8; i++) {
+            cairo_surface_t *s = make_frame(i);
+            n = add_tiles(s, tiles, n, max);
+            cairo_surface_destroy(s);
+        }
+
+    printf("%d non-empty tiles\n", n);
+    run(NULL, tiles, n);
+    for (int id = GROMIT_CODEC_RAW; id <= GROMIT_CODEC_ZSTD; id++)
+        if (codec_by_id(id))
+            run(codec_by_id(id), tiles, n);
+
+    for (int i = 0; i < n; i++)
+        free(tiles[i]);
+    free(tiles);
+    return 0;
+}
@@ -0,0 +1,117 @@
+/*
+  Measures the per-event cost of finding the device data of a motion event
+  with 1, 8 and 32 MPX devices attached: one hash table lookup per drawing
+  call, as draw_line() and the coord_list functions used to do, against
+  one per event by GdkDevice, like devices_lookup() does for GDK events,
+  and one per event by the XI2 id the event carries, like
+  devices_lookup_id() does for the XI2 motion backend. The lookups are the
+  same as in src/input.c, with the same kind of hash table.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+
+/* drawing calls per motion event: a few history samples, each drawn and recorded */
+#define LOOKUPS_PER_EVENT 10
+#define EVENTS 2000000
+
+typedef struct {
+    int id;
+    double lastx, lasty;
+} DeviceData;
+
+static volatile double sink;
+
+/* the body of devices_lookup() */
+static DeviceData *lookup(GHashTable *devdatatable, gpointer device)
+{
+    if (!device)
+        return NULL;
+    return g_hash_table_lookup(devdatatable, device);
+}
+
+/* the body of devices_lookup_id() */
+static DeviceData *lookup_id(GPtrArray *devices_by_id, int xi2_id)
+{
+    if (!devices_by_id || xi2_id < 0 || (guint) xi2_id >= devices_by_id->len)
+        return NULL;
+    return g_ptr_array_index(devices_by_id, xi2_id);
+}
+
+static double bench_per_call(GHashTable *table, gpointer *keys, int n_devices)
+{
+    gint64 start = g_get_monotonic_time();
+    for (int e = 0; e < EVENTS; e++) {
+        gpointer key = keys[e % n_devices];
+        for (int l = 0; l < LOOKUPS_PER_EVENT; l++) {
+            DeviceData *d = lookup(table, key);
+            sink += d->lastx;
+        }
+    }
+    return (g_get_monotonic_time() - start) * 1000.0 / EVENTS;
+}
+
+static double bench_per_event(GHashTable *table, gpointer *keys, int n_devices)
+{
+    gint64 start = g_get_monotonic_time();
+    for (int e = 0; e < EVENTS; e++) {
+        DeviceData *d = lookup(table, keys[e % n_devices]);
+        for (int l = 0; l < LOOKUPS_PER_EVENT; l++)
+            sink += d->lastx;
+    }
+    return (g_get_monotonic_time() - start) * 1000.0 / EVENTS;
+}
+
+static double bench_by_id(GPtrArray *by_id, int *ids, int n_devices)
+{
+    gint64 start = g_get_monotonic_time();
+    for (int e = 0; e < EVENTS; e++) {
+        DeviceData *d = lookup_id(by_id, ids[e % n_devices]);
+        for (int l = 0; l < LOOKUPS_PER_EVENT; l++)
+            sink += d->lastx;
+    }
+    return (g_get_monotonic_time() - start) * 1000.0 / EVENTS;
+}
+
+int main(void)
+{
+    const int counts[] = { 1, 8, 32 };
+
+    printf("%8s %16s %16s %16s\n", "devices", "per call ns", "per event ns", "by XI2 id ns");
+
+    for (guint c = 0; c < G_N_ELEMENTS(counts); c++) {
+        int n = counts[c];
+        GHashTable *table = g_hash_table_new(NULL, NULL);
+        GPtrArray *by_id = g_ptr_array_new();
+        gpointer *keys = g_new(gpointer, n);
+        int *ids = g_new(int, n);
+
+        for (int i = 0; i < n; i++) {
+            DeviceData *d = g_new0(DeviceData, 1);
+            /* XI2 master pointers start at 2 and come in pairs with their keyboards */
+            d->id = 2 + 2 * i;
+            ids[i] = d->id;
+            keys[i] = g_malloc(64); /* stands in for the GdkDevice */
+            g_hash_table_insert(table, keys[i], d);
+            if ((guint) d->id >= by_id->len)
+                g_ptr_array_set_size(by_id, d->id + 1);
+            g_ptr_array_index(by_id, d->id) = d;
+        }
+
+        double per_call = bench_per_call(table, keys, n);
+        double per_event = bench_per_event(table, keys, n);
+        double per_id = bench_by_id(by_id, ids, n);
+        printf("%8d %16.1f %16.1f %16.1f\n", n, per_call, per_event, per_id);
+
+        for (int i = 0; i < n; i++) {
+            g_free(g_hash_table_lookup(table, keys[i]));
+            g_free(keys[i]);
+        }
+        g_hash_table_destroy(table);
+        g_ptr_array_free(by_id, TRUE);
+        g_free(keys);
+        g_free(ids);
+    }
+
+    return 0;
+}
@@ -0,0 +1,137 @@
+/*
+  Compares rasterizing a freehand stroke with one cairo_stroke() per motion
+  segment against collecting the segments of a frame and stroking them as
+  one path per line width, like draw_flush_segments() does.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <cairo.h>
+
+#define SURFACE_SIZE 1024
+#define SEGMENTS_PER_FRAME 16
+
+typedef struct {
+    int x1, y1, x2, y2;
+    unsigned width;
+} Segment;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* random walk with pressure-like width changes */
+static Segment *make_stroke(int n)
+{
+    Segment *s = malloc(n * sizeof(Segment));
+    double x = SURFACE_SIZE / 2, y = SURFACE_SIZE / 2, angle = 0;
+    unsigned width = 8;
+
+    srand(42);
+    for (int i = 0; i < n; i++) {
+        angle += (rand() / (double) RAND_MAX - 0.5) * 0.6;
+        s[i].x1 = x;
+        s[i].y1 = y;
+        x += 3 * cos(angle);
+        y += 3 * sin(angle);
+        if (x < 0 || x > SURFACE_SIZE || y < 0 || y > SURFACE_SIZE) {
+            angle += M_PI;
+            x = s[i].x1;
+            y = s[i].y1;
+        }
+        s[i].x2 = x;
+        s[i].y2 = y;
+        if (rand() % 8 == 0)
+            width = 6 + rand() % 5;
+        s[i].width = width;
+    }
+    return s;
+}
+
+static void per_segment(cairo_t *cr, const Segment *s, int n)
+{
+    for (int i = 0; i < n; i++) {
+        cairo_set_line_width(cr, s[i].width);
+        cairo_move_to(cr, s[i].x1, s[i].y1);
+        cairo_line_to(cr, s[i].x2, s[i].y2);
+        cairo_stroke(cr);
+    }
+}
+
+static void batched(cairo_t *cr, const Segment *s, int n)
+{
+    char done[SEGMENTS_PER_FRAME];
+
+    for (int frame = 0; frame < n; frame += SEGMENTS_PER_FRAME) {
+        const Segment *f = s + frame;
+        int len = n - frame < SEGMENTS_PER_FRAME ? n - frame : SEGMENTS_PER_FRAME;
+
+        for (int i = 0; i < len; i++)
+            done[i] = 0;
+
+        for (int i = 0; i < len; i++) {
+            if (done[i])
+                continue;
+            int connected = 0, lastx = 0, lasty = 0;
+            for (int j = i; j < len; j++) {
+                if (done[j] || f[j].width != f[i].width) {
+                    connected = 0;
+                    continue;
+                }
+                if (!connected || f[j].x1 != lastx || f[j].y1 != lasty)
+                    cairo_move_to(cr, f[j].x1, f[j].y1);
+                cairo_line_to(cr, f[j].x2, f[j].y2);
+                lastx = f[j].x2;
+                lasty = f[j].y2;
+                connected = 1;
+                done[j] = 1;
+            }
+            cairo_set_line_width(cr, f[i].width);
+            cairo_stroke(cr);
+        }
+    }
+}
+
+static double run(const char *name, void (*fn)(cairo_t *, const Segment *, int),
+                  const Segment *s, int n)
+{
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                                          SURFACE_SIZE, SURFACE_SIZE);
+    cairo_t *cr = cairo_create(surface);
+    cairo_set_source_rgba(cr, 1, 0, 0, 0.8);
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+
+    double start = now();
+    fn(cr, s, n);
+    cairo_surface_flush(surface);
+    double rate = n / (now() - start);
+
+    printf("%-12s %12.0f segments/s\n", name, rate);
+
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    return rate;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 200000;
+    if (n <= 0) {
+        printf("Usage: %s [number of segments]\n", argv[0]);
+        return 1;
+    }
+
+    Segment *s = make_stroke(n);
+
+    double a = run("per-segment", per_segment, s, n);
+    double b = run("batched", batched, s, n);
+    printf("speedup      %12.2fx\n", b / a);
+
+    free(s);
+    return 0;
+}
@@ -0,0 +1,154 @@
+/*
+  Replays pen traces through the stroke predictor of src/predict.c and
+  measures how far the predicted position is from where the pen really
+  was that many milliseconds later, next to the distance the ink lags
+  behind without prediction. Traces are files with one "time x y" sample
+  per line, time in ms, given on the command line, or synthetic strokes
+  sampled like a 200 Hz tablet if there are none. Fails if prediction
+  is worse than no prediction on average.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "predict.h"
+
+typedef struct {
+    double t, x, y;
+} Sample;
+
+static const int horizons[] = { 8, 12, 16 };
+#define NHORIZONS (int) (sizeof(horizons) / sizeof(horizons[0]))
+
+/* position at time 't' by linear interpolation, 0 if past the end */
+static int truth(const Sample *s, int n, double t, double *x, double *y)
+{
+    for (int i = 1; i < n; i++)
+        if (s[i].t >= t) {
+            double f = s[i].t > s[i-1].t ? (t - s[i-1].t) / (s[i].t - s[i-1].t) : 1;
+            *x = s[i-1].x + f * (s[i].x - s[i-1].x);
+            *y = s[i-1].y + f * (s[i].y - s[i-1].y);
+            return 1;
+        }
+    return 0;
+}
+
+/* 1.5 s of the given shape, 1 ms ticks for ground truth, every 5th is a sample */
+static Sample *synth(int shape, int *n)
+{
+    Sample *s = malloc(1500 * sizeof(Sample));
+    srand(shape);
+    for (int i = 0; i < 1500; i++) {
+        double t = i / 1000.0;
+        s[i].t = i;
+        switch (shape) {
+        case 0: /* circles, one per second */
+            s[i].x = 500 + 150 * cos(2 * M_PI * t);
+            s[i].y = 500 + 150 * sin(2 * M_PI * t);
+            break;
+        case 1: /* handwriting-like loops moving to the right */
+            s[i].x = 100 + 300 * t + 40 * sin(2 * M_PI * 3 * t);
+            s[i].y = 500 + 60 * sin(2 * M_PI * 4 * t + 1);
+            break;
+        default: /* a straight line that starts and stops */
+            s[i].x = 100 + 800 * (1 - cos(M_PI * t / 1.5)) / 2;
+            s[i].y = 300 + 200 * (1 - cos(M_PI * t / 1.5)) / 2;
+            break;
+        }
+    }
+    *n = 1500;
+    return s;
+}
+
+static Sample *load(const char *path, int *n)
+{
+    FILE *f = fopen(path, "r");
+    int max = 1024;
+    Sample *s = malloc(max * sizeof(Sample));
+
+    if (!f) {
+        fprintf(stderr, "Could not read %s\n", path);
+        exit(1);
+    }
+    *n = 0;
+    while (fscanf(f, "%lf %lf %lf", &s[*n].t, &s[*n].x, &s[*n].y) == 3)
+        if (++*n == max)
+            s = realloc(s, (max *= 2) * sizeof(Sample));
+    fclose(f);
+    return s;
+}
+
+static int cmp(const void *a, const void *b)
+{
+    double d = *(const double *) a - *(const double *) b;
+    return (d > 0) - (d < 0);
+}
+
+/* feed every 'step'th sample, returns FALSE if prediction does not help */
+static int replay(const char *name, const Sample *s, int n, int step)
+{
+    double *err = malloc(n * sizeof(double));
+    double *lag = malloc(n * sizeof(double));
+    int ok = 1;
+
+    printf("%s\n", name);
+    for (int h = 0; h < NHORIZONS; h++) {
+        GromitPredictor p;
+        double sum_err = 0, sum_lag = 0;
+        int m = 0;
+
+        predictor_reset(&p);
+        for (int i = 0; i < n; i += step) {
+            double px, py, tx, ty;
+            /* sensor noise and integer coordinates, as with a mouse */
+            double x = step > 1 ? round(s[i].x + (rand() % 3 - 1) * 0.5) : s[i].x;
+            double y = step > 1 ? round(s[i].y + (rand() % 3 - 1) * 0.5) : s[i].y;
+
+            predictor_add(&p, x, y, (guint32) s[i].t);
+            if (!predictor_predict(&p, horizons[h], &px, &py) ||
+                !truth(s, n, s[i].t + horizons[h], &tx, &ty))
+                continue;
+            err[m] = hypot(px - tx, py - ty);
+            lag[m] = hypot(x - tx, y - ty);
+            sum_err += err[m];
+            sum_lag += lag[m];
+            m++;
+        }
+        if (m == 0)
+            continue;
+        qsort(err, m, sizeof(double), cmp);
+        qsort(lag, m, sizeof(double), cmp);
+        printf("  %2d ms  predicted mean %6.2f px  p95 %6.2f px   unpredicted mean %6.2f px  p95 %6.2f px\n",
+               horizons[h], sum_err / m, err[m * 95 / 100], sum_lag / m, lag[m * 95 / 100]);
+        if (sum_err > sum_lag)
+            ok = 0;
+    }
+
+    free(err);
+    free(lag);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *shapes[] = { "circles", "loops", "line" };
+    int ok = 1;
+
+    if (argc > 1)
+        for (int i = 1; i < argc; i++) {
+            int n;
+            Sample *s = load(argv[i], &n);
+            ok &= replay(argv[i], s, n, 1);
+            free(s);
+        }
+    else
+        for (int shape = 0; shape < 3; shape++) {
+            int n;
+            Sample *s = synth(shape, &n);
+            ok &= replay(shapes[shape], s, n, 5);
+            free(s);
+        }
+
+    if (!ok)
+        printf("FAIL: prediction is worse than none\n");
+    return ok ? 0 : 1;
+}
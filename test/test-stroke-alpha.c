@@ -0,0 +1,112 @@
+/*
+  Draws a translucent stroke over several frames the way draw_flush_segments()
+  does for pens with alpha < 1: every frame fills its part of the stroke,
+  with round ends, to a stroke layer in the opaque color, and the layer is
+  painted to the backbuffer with the alpha of the color once the stroke
+  ends. Checks that the alpha is the same all along the stroke, where the
+  parts of consecutive frames overlap, too, and that what on_expose() shows
+  during the stroke matches the result. Also prints the alpha that filling
+  every frame straight to the backbuffer leaves at the joins.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "tiles.h"
+
+#define WIDTH 600
+#define HEIGHT 300
+#define FRAMES 7
+#define PEN_WIDTH 12
+#define ALPHA 0.5
+
+/* one frame of a horizontal stroke along y = HEIGHT / 2 */
+static void frame_path(cairo_t *ctx, int frame)
+{
+    int x0 = 40 + frame * 70, x1 = x0 + 70;
+
+    cairo_set_line_width(ctx, PEN_WIDTH);
+    cairo_set_line_cap(ctx, CAIRO_LINE_CAP_ROUND);
+    cairo_move_to(ctx, x0, HEIGHT / 2);
+    cairo_line_to(ctx, x1, HEIGHT / 2);
+}
+
+static int alpha_at(GromitTiledSurface *ts, int x, int y)
+{
+    guint idx = (y / GROMIT_TILE_SIZE) * ts->cols + x / GROMIT_TILE_SIZE;
+    const guchar *data = tiled_surface_get_tile_data(ts, idx);
+    if (!data)
+        return 0;
+    return data[(y % GROMIT_TILE_SIZE) * GROMIT_TILE_STRIDE + (x % GROMIT_TILE_SIZE) * 4 + 3];
+}
+
+/* smallest and largest alpha on the center line of the stroke */
+static void alpha_range(GromitTiledSurface *ts, int *min, int *max)
+{
+    *min = 255;
+    *max = 0;
+    for (int x = 40 + PEN_WIDTH; x < 40 + FRAMES * 70 - PEN_WIDTH; x++) {
+        int a = alpha_at(ts, x, HEIGHT / 2);
+        if (a < *min)
+            *min = a;
+        if (a > *max)
+            *max = a;
+    }
+}
+
+int main(void)
+{
+    GromitTiledSurface *backbuffer = tiled_surface_new(WIDTH, HEIGHT);
+    GromitTiledSurface *layer = tiled_surface_new(WIDTH, HEIGHT);
+    GromitTiledSurface *direct = tiled_surface_new(WIDTH, HEIGHT);
+    cairo_t *ctx = cairo_create(backbuffer->proxy);
+    int failed = 0, min, max;
+
+    for (int frame = 0; frame < FRAMES; frame++) {
+        cairo_set_source_rgb(ctx, 1, 0, 0);
+        frame_path(ctx, frame);
+        tiled_surface_stroke(layer, ctx);
+
+        cairo_set_source_rgba(ctx, 1, 0, 0, ALPHA);
+        frame_path(ctx, frame);
+        tiled_surface_stroke(direct, ctx);
+    }
+
+    /* what on_expose() shows before the stroke ends */
+    cairo_surface_t *screen = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, WIDTH, HEIGHT);
+    cairo_t *cr = cairo_create(screen);
+    GdkRectangle all = { 0, 0, WIDTH, HEIGHT };
+    tiled_surface_paint(backbuffer, cr, &all);
+    tiled_surface_paint_over(layer, cr, &all, ALPHA);
+    cairo_destroy(cr);
+    cairo_surface_flush(screen);
+
+    tiled_surface_composite(backbuffer, layer, ALPHA);
+
+    alpha_range(backbuffer, &min, &max);
+    printf("layered: alpha %d..%d on the center line\n", min, max);
+    if (max - min > 1 || abs(min - (int) (ALPHA * 255)) > 1) {
+        printf("FAIL: alpha not uniform along the stroke\n");
+        failed = 1;
+    }
+
+    const guchar *pixels = cairo_image_surface_get_data(screen);
+    int stride = cairo_image_surface_get_stride(screen);
+    for (int y = 0; y < HEIGHT && !failed; y++)
+        for (int x = 0; x < WIDTH; x++)
+            if (abs(pixels[y * stride + x * 4 + 3] - alpha_at(backbuffer, x, y)) > 1) {
+                printf("FAIL: screen differs from the result at %d,%d\n", x, y);
+                failed = 1;
+                break;
+            }
+
+    alpha_range(direct, &min, &max);
+    printf("direct:  alpha %d..%d on the center line\n", min, max);
+
+    cairo_surface_destroy(screen);
+    cairo_destroy(ctx);
+    tiled_surface_free(direct);
+    tiled_surface_free(layer);
+    tiled_surface_free(backbuffer);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}